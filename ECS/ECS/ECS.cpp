@@ -1,271 +1,2444 @@
 #include "ECS.h"
 #include <algorithm>	// Contains std::sort
+#include <thread>
+
+#ifdef ECS_SNAPSHOT_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 // Extern setting
-CompID unsetComponentID = 0;
+std::atomic<size_t> nextTypeIndex = 0;
+
+ECS::ECS()
+{
+
+}
+
+ECS::~ECS()
+{
+	// Clean up the live runtime components that need it (a fork's copies are its own) before their pools are deleted
+	if (runtimeDestroyMask.any())
+	{
+		for (size_t id = 0, end = getEntityEnd(); id < end; id++)
+			(entities[id].compMask & runtimeDestroyMask).forEach([&](CompID i)
+			{
+				runtimeComponents[i].destroy(componentPools[i]->get(getComponentIndex(i, (EntityID)id)));
+			});
+	}
+
+	for (auto ptr : componentPools)
+	{
+		delete ptr;
+		ptr = 0;
+	}
+	componentPools.clear();
+
+	for (auto ptr : componentIndices)
+		delete ptr;
+	componentIndices.clear();
+	fieldIndices.clear();
+	indicesByComp.clear();
+
+	for (auto& storage : singletons)
+	{
+		if (storage.data)
+			storage.destroy(storage.data);
+		storage.data = 0;
+	}
+	singletons.clear();
+
+#if REFAC == 2
+
+	for (auto ptr : componentSparseSets)
+	{
+		delete ptr;
+		ptr = 0;
+	}
+	componentSparseSets.clear();
+
+	for (auto ptr : owningGroups)
+	{
+		delete ptr;
+		ptr = 0;
+	}
+	owningGroups.clear();
+	componentOwningGroups.clear();
+
+#endif
+
+#if IMPL == 3
+
+	for (auto ptr : sortingGroups)
+	{
+		delete ptr;
+		ptr = 0;
+	}
+	sortingGroups.clear();
+
+	for (auto ptr : entityGroups)
+	{
+		delete ptr;
+		ptr = 0;
+	}
+	entityGroups.clear();
+
+#endif
+}
+
+// Makes sure each of the arrays indexed by comp ID has room for this many components
+// New components are left without a pool until createComp<>() is called for them
+void ECS::resizeComponentArrays(size_t noOfComponents)
+{
+	if (componentPools.size() >= noOfComponents)
+		return;
+
+	componentPools.resize(noOfComponents, 0);
+	componentEvents.resize(noOfComponents);
+	disabledCounts.resize(noOfComponents, 0);
+	bufferElementSizes.resize(noOfComponents, 0);
+	runtimeComponents.resize(noOfComponents);
+	indicesByComp.resize(noOfComponents);
+
+#if REFAC == 2
+
+	componentSparseSets.resize(noOfComponents, 0);
+	componentOwningGroups.resize(noOfComponents, 0);	// New components aren't owned by a group
+	defragmentSlots.resize(noOfComponents, 0);		// Defragmenting a new component starts from its first slot
+
+#endif
+}
+
+// This switches entities in the entity array and handles the switching of components (implementation and refactor dependant)
+void ECS::switchEntities(EntityID a, EntityID b)
+{
+	if (a == b)
+		return;
+
+	// Switch all component data
+	switchComponents(a, b);
+	switchQueuedEvents(a, b);
+
+	// Switch comp masks (and which of their components are disabled)
+	std::swap(entities[a].compMask, entities[b].compMask);
+	std::swap(entities[a].disabledMask, entities[b].disabledMask);
+	touchEntity(a);
+	touchEntity(b);
+
+	// Point the hierarchy links at the entities' new IDs
+	relinkHierarchy(a, b);
+	switchIndexedComponents(a, b);
+}
+
+// This transfer an entity from one place to another (implementation and refactor dependant)
+void ECS::transferEntity(EntityID from, EntityID to)
+{
+	if (from == to)
+		return;
+
+	// Transfer components
+	transferComponents(from, to);
+	moveQueuedEvents(from, to);
+
+	// Set comp masks (disabled components stay disabled)
+	entities[to].compMask = entities[from].compMask;
+	entities[to].disabledMask = entities[from].disabledMask;
+	entities[from].compMask.reset();
+	entities[from].disabledMask.reset();
+	touchEntity(from);
+	touchEntity(to);
+
+	// Point the hierarchy links at the entity's new ID
+	relinkHierarchy(from, to);
+	moveIndexedComponents(from, to);
+}
+
+// This Transfers all components from an entity to another and is optimized to ignore the old components
+// This is handy for whenever the old entity is about to be deleted etc (but is still implemmentation specific)
+void ECS::transferComponents(EntityID from, EntityID to)
+{
+	if (from == to)
+		return;
+
+	// Loop through each component this entity has (tags have no data to move)
+	(entities[from].compMask & componentDataMask).forEach([&](CompID i)
+	{
+		// NOTE, i is the compID which is deliberately fixed as such when the components were created with initComponents<>()
+
+#if REFAC == 1
+
+		// This method requires all component data is copied from one location to another in the components arrays
+		// Directly transfer component data across
+		componentPools[i]->copy(from, to);
+		componentPools[i]->ticks[to] = currentTick;	// The entity at this ID is now different, so it has changed
+
+#elif REFAC == 2
+
+		// This method only requires the changing of an integer in each component sparse set
+		// The entityID has moved so we must tell it in the new sparse set location where it's component is (the old sparse set location's element)
+		auto* sparseSet = componentSparseSets[i];
+		sparseSet->emplace(to);
+		sparseSet->index(to) = sparseSet->index(from);	// Transfer new component location into place
+		sparseSet->dense[sparseSet->index(to)] = to;		// Tell the dense array who now owns the component
+		sparseSet->release(from);						// The old location no longer uses the sparse array
+		componentPools[i]->ticks[sparseSet->index(to)] = currentTick;	// The entity at this ID is now different, so it has changed
+
+#endif
+	});
+}
+
+// This switches components from a and b
+// This is used for refactoring purposes
+void ECS::switchComponents(EntityID a, EntityID b)
+{
+	if (a == b)
+		return;
+
+	// Loop through each component either entity has, components neither has don't hold any data worth keeping (and tags have no data)
+	((entities[a].compMask | entities[b].compMask) & componentDataMask).forEach([&](CompID i)
+	{
+		// NOTE, i is the compID which is deliberately fixed as such when the components were created with initComponents<>()
+
+#if REFAC == 1
+
+		// This method requires all component data is copied from one location to another in the components arrays
+		// Directly transfer component data across
+		componentPools[i]->switch_(a, b);
+
+		// The entities at these IDs are now different, so they have changed
+		componentPools[i]->ticks[a] = currentTick;
+		componentPools[i]->ticks[b] = currentTick;
+
+#elif REFAC == 2
+
+		// This method only requires the changing of an integer in each component sparse set
+		// The entityIDs have swapped so each must be told in its new sparse set location where its component is
+		// Unlike REFAC 1 the owners are tracked by the dense array, so only components that are actually owned can be moved
+		const bool bAHasComp = entities[a].compMask.test(i);
+		const bool bBHasComp = entities[b].compMask.test(i);
+		auto* sparseSet = componentSparseSets[i];
+
+		// If only one entity has this component, the other's slot in the sparse array must be reserved (and the old one freed)
+		if (bAHasComp != bBHasComp)
+			sparseSet->emplace(bAHasComp ? b : a);
+
+		const auto old = bAHasComp ? sparseSet->index(a) : 0;	// Save old component location
+		if (bBHasComp)
+		{
+			sparseSet->index(a) = sparseSet->index(b);	// Transfer new component location into place
+			sparseSet->dense[sparseSet->index(a)] = a;	// Update owner
+			componentPools[i]->ticks[sparseSet->index(a)] = currentTick;	// The entity at this ID is now different, so it has changed
+		}
+		if (bAHasComp)
+		{
+			sparseSet->index(b) = old;					// Give the other entity its component
+			sparseSet->dense[old] = b;					// Update owner
+			componentPools[i]->ticks[old] = currentTick;
+		}
+
+		if (bAHasComp != bBHasComp)
+			sparseSet->release(bAHasComp ? a : b);
+
+#endif
+	});
+}
+
+void ECS::destroyEntity(EntityID entityID)
+{
+	// Return if entity is already dead
+	if (entities[entityID].compMask.none())
+		return;
+
+	//std::cout << "Destroyed one \n";
+
+	auto finalizeDestruction = [&](EntityID index)
+	{
+		// Unlink the entity from its parent and children, its children become roots
+		if (inHierarchy(index))
+			detachFromHierarchy(index);
+
+		// Remove the entity from indices
+		unindexComponents(entities[index].compMask, index);
+
+		// Clean up runtime components that need it
+		(entities[index].compMask & runtimeDestroyMask).forEach([&](CompID i)
+		{
+			runtimeComponents[i].destroy(componentPools[i]->get(getComponentIndex(i, index)));
+		});
+
+		// Tell reactive systems about each observed component being removed
+		(entities[index].compMask & observedMask).forEach([&](CompID i)
+		{
+			queueRemovedEvent(i, index);
+		});
+
+#if REFAC == 2
+
+		// Free this entity's components
+		// Loop through each component this entity has (tags aren't in sparse sets)
+		(entities[index].compMask & componentDataMask).forEach([&](CompID i)
+		{
+			// NOTE, i is the compID which is deliberately fixed as such when the components were created with initComponents<>()
+
+			// Remove the component from the sparse set O(1), this keeps the dense array packed
+			removeFromSparseSet(i, index);
+		});
+
+#endif
+
+		// Set entity's comp mask to 0 (kills/destroys it)
+		enableAllComps(index);
+		entities[index].compMask.reset();
+		touchEntity(index);
+	};
+
+	// Decrement counter
+	noOfEntities--;
+
+	// Implementation 1 does nothing to the components in the component array as they are reset when they are assigned to an entity. 
+#if IMPL == 1
+
+	finalizeDestruction(entityID);
+
+#elif IMPL == 2
+
+	// This implementation must ensure all entities are at the beginning of the array. 
+	// Kill the entity first (so its components are freed), then take the entity at the end of the array and slot it into the new available space
+	finalizeDestruction(entityID);
+	transferEntity(noOfEntities, entityID);
+
+#elif IMPL == 3
+
+	// This implementation must ensure the entity group remains contiguous
+	// Move the last entity into the slot where the dead entity was and adjust entity group info accordingly
+
+	// Find dead entity's group
+	ecs::EntityGroup* group = 0;
+	for (int i = 0; i < entityGroups.size(); i++)
+	{
+		if (entityGroups[i]->compMask == entities[entityID].compMask)
+		{
+			group = entityGroups[i];
+			break;
+		}
+	}
+	assert(group);
+
+	// Kill the entity, then move the end entity into its place
+	const auto aliveIndex = group->getEndIndex();
+	finalizeDestruction(entityID);
+	transferEntity(aliveIndex, entityID);
+
+	// Update group size
+	group->noOfEntities--;
+
+#endif
+}
+
+// Sets up the change detection ticks for a system about to run
+void ECS::beginSystem(size_t typeIndex)
+{
+	if (typeIndex >= systemTicks.size())
+		systemTicks.resize(typeIndex + 1, 0);
+
+	// Each system runs on its own tick, so it sees what other systems have written since its last run but not its own writes
+	systemLastTick = systemTicks[typeIndex];
+	currentTick++;
+}
+
+void ECS::endSystem(size_t typeIndex)
+{
+	systemTicks[typeIndex] = currentTick;
+	systemLastTick = 0;
+}
+
+// Creates a component described at runtime and returns its comp ID
+CompID ECS::registerComponent(const std::string& name, size_t size, size_t alignment, void (*construct)(void*), void (*destroy)(void*),
+	void (*copy)(void*, const void*))
+{
+	// Alignment must be a power of 2 and names must be unique (and not empty)
+	assert(alignment != 0 && (alignment & (alignment - 1)) == 0);
+	assert(!name.empty() && getRuntimeCompID(name) == -1);
+
+	// Check there's room before the cast, a comp ID can't hold MAX_COMPONENTS
+	assert(componentPools.size() < MAX_COMPONENTS);
+	const CompID compID = (CompID)componentPools.size();
+	firstRuntimeCompID = std::min(firstRuntimeCompID, (size_t)compID);
+	resizeComponentArrays(compID + 1);
+
+	auto& info = runtimeComponents[compID];
+	info.name = name;
+	info.size = size;
+	info.construct = construct;
+	info.destroy = destroy;
+	info.copy = copy;
+	if (destroy && size)
+		runtimeDestroyMask.set(compID);
+
+	// Tags (empty components) have no pool, they are only stored as bits in the comp masks
+	if (size == 0)
+		return compID;
+
+	// Round the size up to the alignment so each element in the pool is aligned
+	componentPools[compID] = new ecs::ComponentPool((size + alignment - 1) & ~(alignment - 1), alignment);
+	componentDataMask.set(compID);
+
+#if REFAC == 2
+
+	// Setup sparse set
+	componentSparseSets[compID] = new ecs::SparseSet();
+
+#endif
+
+	return compID;
+}
+
+// Returns the comp ID of a runtime component, or -1 if there isn't one with this name (every CompID value can be a real comp ID)
+int ECS::getRuntimeCompID(const std::string& name)
+{
+	// Compiled components have no name, so they never match
+	for (size_t i = 0; i < runtimeComponents.size(); i++)
+		if (runtimeComponents[i].name == name)
+			return (int)i;
+	return -1;
+}
+
+// The runtime counterpart of assignComp<T>()
+void ECS::assignComp(CompID compID, EntityID entityID)
+{
+	const bool bHadComp = entities[entityID].compMask.test(compID);
+	touchEntity(entityID);
+
+	// Re-assigning a component only re-initializes it, so it's only an add event if the entity didn't have it
+	if (!bHadComp)
+		queueAddedEvent(compID, entityID);
+
+	// Tags have no data, so they are just a bit in the comp mask
+	if (!componentDataMask.test(compID))
+	{
+		entities[entityID].compMask.set(compID);
+		return;
+	}
+
+#if REFAC == 2
+
+	// The component is appended to the end of the dense array in constant time
+	if (!bHadComp)
+	{
+		entities[entityID].compMask.set(compID);
+		addToSparseSet(compID, entityID);	// The comp mask must be set first so owning groups can see the entity has the component
+	}
+
+#endif
+
+	// Set comp mask
+	entities[entityID].compMask.set(compID);
+
+	// Initialise the component, cleaning up the old one if it's being re-assigned
+	const auto& info = runtimeComponents[compID];
+	void* comp = getEntitysComponent(compID, entityID);
+	if (bHadComp && info.destroy)
+		info.destroy(comp);
+	if (info.construct)
+		info.construct(comp);
+	else
+		memset(comp, 0, componentPools[compID]->elementSize);
+
+	if (indexedCompMask.test(compID))
+		indexComponent(compID, entityID);
+}
+
+// The runtime counterpart of unassignComp<T>()
+void ECS::unassignComp(CompID compID, EntityID entityID)
+{
+	// Return if the entity doesn't have this component
+	if (!entities[entityID].compMask.test(compID))
+		return;
+
+	touchEntity(entityID);
+
+	if (indexedCompMask.test(compID))
+	{
+		CompMask compMask;
+		compMask.set(compID);
+		unindexComponents(compMask, entityID);
+	}
+
+	if (runtimeDestroyMask.test(compID))
+		runtimeComponents[compID].destroy(componentPools[compID]->get(getComponentIndex(compID, entityID)));
+
+#if REFAC == 2
+
+	// Free the component's slot, this moves the last component of the dense array into it
+	if (componentDataMask.test(compID))
+		removeFromSparseSet(compID, entityID);
+
+#endif
+
+	// A component that is assigned again starts enabled
+	enableCompByID(compID, entityID);
+
+	entities[entityID].compMask.set(compID, false);
+	queueRemovedEvent(compID, entityID);
+}
+
+// The runtime counterpart of getEntitysComponent<T>()
+void* ECS::getEntitysComponent(CompID compID, EntityID entityID)
+{
+	assert(componentDataMask.test(compID));	// Tags have no data
+
+	auto* pool = componentPools[compID];
+	const size_t compIndex = getComponentIndex(compID, entityID);
+
+	// The caller can write to the component, so mark it as changed
+	pool->ticks[compIndex] = currentTick;
+	if (indexedCompMask.test(compID))
+		markIndexedComponentDirty(compID, entityID);
+
+	return pool->get(compIndex);
+}
+
+// The runtime counterpart of getEntitiesWithComponents<T...>(), the comp mask can mix compiled and runtime components
+unique_ptr<vector<EntityID>> ECS::getEntitiesWithComponents(CompMask compMask)
+{
+	unique_ptr<vector<EntityID>> output = std::make_unique<vector<EntityID>>();
+
+	// Entities only need their disabled components checked if one of these components is disabled on any entity
+	const bool bCheckDisabled = (disabledCompMask & compMask).any();
+	auto isEnabled = [&](EntityID i) { return !bCheckDisabled || (entities[i].disabledMask & compMask).none(); };
+
+#if IMPL < 3
+
+	for (int i = 0; i < getNoOfEntities(); i++)
+		if (entities[i].compMask.contains(compMask) && isEnabled(i))
+			output->push_back(i);
+
+#elif IMPL == 3
+
+	for (auto group : entityGroups)
+		if (group->compMask.contains(compMask))
+			for (int i = group->startIndex; i < group->getNextIndex(); i++)
+				if (isEnabled(i))
+					output->push_back(i);
+
+#endif
+
+	return output;
+}
+
+// Adds a newly assigned component to its indices, its value is read the next time each index is searched
+void ECS::indexComponent(CompID compID, EntityID entityID)
+{
+	for (auto* index : indicesByComp[compID])
+		index->addLater(entityID);
+}
+
+// Removes an entity from the indices of these components
+void ECS::unindexComponents(CompMask compMask, EntityID entityID)
+{
+	(compMask & indexedCompMask).forEach([&](CompID i)
+	{
+		for (auto* index : indicesByComp[i])
+			index->remove(entityID);
+	});
+}
+
+// Moves an entity's index entries to its new ID (the entity's comp mask must already be at the new ID)
+void ECS::moveIndexedComponents(EntityID from, EntityID to)
+{
+	(entities[to].compMask & indexedCompMask).forEach([&](CompID i)
+	{
+		for (auto* index : indicesByComp[i])
+			index->move(from, to);
+	});
+}
+
+// Switches two entities' index entries
+void ECS::switchIndexedComponents(EntityID a, EntityID b)
+{
+	((entities[a].compMask | entities[b].compMask) & indexedCompMask).forEach([&](CompID i)
+	{
+		for (auto* index : indicesByComp[i])
+			index->switch_(a, b);
+	});
+}
+
+// The component has been handed out to be written, so its indices must re-read it before they are next searched
+void ECS::markIndexedComponentDirty(CompID compID, EntityID entityID)
+{
+	for (auto* index : indicesByComp[compID])
+		index->markDirty(entityID);
+}
+
+// Re-reads the values of components that may have been written since the index was last searched
+void ECS::refreshDirtyIndexEntries(ecs::ComponentIndex* index)
+{
+	// An ID may be stale if the entity has since moved or lost the component
+	auto& dirtyEntities = index->dirtyEntities;
+	dirtyEntities.erase(std::remove_if(dirtyEntities.begin(), dirtyEntities.end(), [&](EntityID entityID) { return !entities[entityID].compMask.test(index->compID); }), dirtyEntities.end());
+
+	// Take all of the old values out of a unique index before adding the new ones, so two entities that have swapped values don't clash
+	// Other indices update each entity in place, which lets them skip values that haven't changed
+	if (index->bUnique)
+		for (auto entityID : dirtyEntities)
+			index->remove(entityID);
+	for (auto entityID : dirtyEntities)
+		index->add(entityID, componentPools[index->compID]->get(getComponentIndex(index->compID, entityID)));
+
+	dirtyEntities.clear();
+}
+
+// Slides the overflow blocks still used by live buffer components to the front of the arena, dropping the space of outgrown and removed buffers
+void ECS::compactBufferArena()
+{
+	// Find the overflow blocks in use
+	struct Block
+	{
+		size_t offset;
+		size_t bytes;
+		ecs::BufferHeader* header;
+		Tick* tick;		// The component's change tick, moving its block changes the component
+	};
+	vector<Block> blocks;
+
+	auto addBlock = [&](CompID compID, size_t compIndex)
+	{
+		auto* header = static_cast<ecs::BufferHeader*>(componentPools[compID]->get(compIndex));
+		if (header->overflowCapacity)
+			blocks.push_back({ header->overflowOffset, header->overflowCapacity * bufferElementSizes[compID], header, &componentPools[compID]->ticks[compIndex] });
+	};
+
+	bufferCompMask.forEach([&](CompID i)
+	{
+#if REFAC == 1
+
+		// Only the components of alive entities are in use
+		forEachEntityWithComponent(i, [&](EntityID entityID) { addBlock(i, entityID); });
+
+#elif REFAC == 2
+
+		// The dense array is packed, so every component in it is in use
+		for (size_t j = 0; j < componentSparseSets[i]->size(); j++)
+			addBlock(i, j);
+
+#endif
+	});
+
+	// Slide the blocks down in order, so no block is written over before it has been moved
+	std::sort(blocks.begin(), blocks.end(), [](const Block& a, const Block& b) { return a.offset < b.offset; });
+
+	size_t end = 0;
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		// A copied buffer shares its block with the original, so keep sharing it
+		size_t offset;
+		if (i > 0 && blocks[i].offset == blocks[i - 1].offset)
+			offset = blocks[i - 1].header->overflowOffset;
+		else
+		{
+			offset = (end + ecs::BufferArena::blockAlignment - 1) & ~(ecs::BufferArena::blockAlignment - 1);
+			memmove(bufferArena.data.data() + offset, bufferArena.data.data() + blocks[i].offset, blocks[i].bytes);
+			end = offset + blocks[i].bytes;
+		}
+
+		if (blocks[i].header->overflowOffset != offset)
+		{
+			blocks[i].header->overflowOffset = offset;
+			*blocks[i].tick = currentTick;
+		}
+	}
+
+	// Keep the capacity, the freed space will be reused as buffers grow again
+	bufferArena.data.resize(end);
+}
+
+// Makes child the first child of parent, moving it (and its descendants) from any previous parent
+void ECS::setParent(EntityID child, EntityID parent)
+{
+	assert(inHierarchy(child) && inHierarchy(parent) && child != parent);
+
+	// The parent can't be one of the child's descendants
+	for (EntityID ancestor = getHierarchy(parent)->parent; ancestor != ecs::Hierarchy::none; ancestor = getHierarchy(ancestor)->parent)
+		assert(ancestor != child);
+
+	removeParent(child);
+
+	// Add the child to the front of the parent's children O(1)
+	auto* childHierarchy = getHierarchy(child);
+	auto* parentHierarchy = getHierarchy(parent);
+	childHierarchy->parent = parent;
+	childHierarchy->nextSibling = parentHierarchy->firstChild;
+	parentHierarchy->firstChild = child;
+
+	updateHierarchyDepths(child);
+	bHierarchyIsSorted = false;
+}
+
+// Makes child a root, it keeps its own children
+void ECS::removeParent(EntityID child)
+{
+	assert(inHierarchy(child));
+
+	auto* childHierarchy = getHierarchy(child);
+	if (childHierarchy->parent == ecs::Hierarchy::none)
+		return;
+
+	// Remove the child from its parent's children
+	auto* parentHierarchy = getHierarchy(childHierarchy->parent);
+	if (parentHierarchy->firstChild == child)
+		parentHierarchy->firstChild = childHierarchy->nextSibling;
+	else
+	{
+		// Find the sibling before the child
+		EntityID sibling = parentHierarchy->firstChild;
+		while (getHierarchy(sibling)->nextSibling != child)
+			sibling = getHierarchy(sibling)->nextSibling;
+		getHierarchy(sibling)->nextSibling = childHierarchy->nextSibling;
+	}
+
+	childHierarchy->parent = ecs::Hierarchy::none;
+	childHierarchy->nextSibling = ecs::Hierarchy::none;
+
+	updateHierarchyDepths(child);
+	bHierarchyIsSorted = false;
+}
+
+// Sorts the hierarchy's members breadth first (roots, then their children, then their grandchildren...) so a parent is always before its children
+// The members are reordered amongst the IDs they already use with switchEntities. Under implementation 3 the members of each entity group are
+// reordered amongst themselves so the groups stay intact, meaning a parent is only guaranteed to be before its children when they're in the same group
+// Under REFAC 2 the hierarchy's dense array is then sorted to match (unless a group owns it)
+void ECS::sortHierarchy()
+{
+	if (bHierarchyIsSorted || hierarchyCompID == -1)
+		return;
+
+	// Rank the members breadth first, starting from the roots in entity order
+	vector<EntityID> order;
+	forEachEntityWithComponent((CompID)hierarchyCompID, [&](EntityID entityID)
+	{
+		if (readHierarchy(entityID)->parent == ecs::Hierarchy::none)
+			order.push_back(entityID);
+	});
+	for (size_t i = 0; i < order.size(); i++)
+		for (EntityID child = readHierarchy(order[i])->firstChild; child != ecs::Hierarchy::none; child = readHierarchy(child)->nextSibling)
+			order.push_back(child);
+
+#if IMPL < 3
+
+	placeEntities(order);
+
+#elif IMPL == 3
+
+	// Before the first refactor there are no groups to keep intact
+	if (entityGroups.empty())
+		placeEntities(order);
+
+	// Every entity in a group with the hierarchy is a member, so each group's members are placed back into its own range
+	for (auto* group : entityGroups)
+	{
+		if (!group->compMask.test((CompID)hierarchyCompID))
+			continue;
+
+		vector<EntityID> groupOrder;
+		for (auto entityID : order)
+			if (entityID >= group->startIndex && entityID < group->getNextIndex())
+				groupOrder.push_back(entityID);
+
+		placeEntities(groupOrder);
+	}
+
+#endif
+
+#if REFAC == 2
+
+	// Put the hierarchy's components in the same order as the entities
+	if (!componentOwningGroups[hierarchyCompID])
+		sortComponentPool((CompID)hierarchyCompID);
+
+#endif
+
+	bHierarchyIsSorted = true;
+}
+
+// Moves the entities (given by their current IDs in the order they should end up in) into the IDs they use in increasing order
+// The hierarchy links are pointed at the new IDs once at the end, rather than walking the moved entities' siblings on every switch
+void ECS::placeEntities(vector<EntityID>& ranked)
+{
+	const vector<EntityID> original = ranked;
+	vector<EntityID> slots = ranked;
+	std::sort(slots.begin(), slots.end());
+	auto slotIndex = [&](EntityID entityID) { return size_t(std::lower_bound(slots.begin(), slots.end(), entityID) - slots.begin()); };
+
+	// The rank of the entity currently in each slot
+	vector<size_t> rankInSlot(slots.size());
+	for (size_t i = 0; i < ranked.size(); i++)
+		rankInSlot[slotIndex(ranked[i])] = i;
+
+	// Every slot before i is already final, so the entity we need is always at or after i
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		const EntityID current = ranked[i];
+		if (current == slots[i])
+			continue;
+
+		// The entity in this slot moves to where the entity ranked i was
+		const size_t displacedRank = rankInSlot[i];
+		bDeferRelink = true;
+		switchEntities(slots[i], current);
+		bDeferRelink = false;
+		ranked[displacedRank] = current;
+		rankInSlot[slotIndex(current)] = displacedRank;
+	}
+
+	// The entity ranked i has moved from original[i] to slots[i]
+	vector<std::pair<EntityID, EntityID>> moves;
+	for (size_t i = 0; i < slots.size(); i++)
+		if (original[i] != slots[i] && inHierarchy(slots[i]))
+			moves.emplace_back(original[i], slots[i]);
+	if (moves.empty())
+		return;
+
+	// Links to entities that weren't placed are left as they are
+	std::sort(moves.begin(), moves.end());
+	auto remap = [&](EntityID entityID)
+	{
+		auto it = std::lower_bound(moves.begin(), moves.end(), std::make_pair(entityID, EntityID(0)));
+		return it != moves.end() && it->first == entityID ? it->second : entityID;
+	};
+	forEachEntityWithComponent((CompID)hierarchyCompID, [&](EntityID entityID)
+	{
+		const auto* links = readHierarchy(entityID);
+		const EntityID parent = remap(links->parent), firstChild = remap(links->firstChild), nextSibling = remap(links->nextSibling);
+		if (parent == links->parent && firstChild == links->firstChild && nextSibling == links->nextSibling)
+			return;
+
+		auto* hierarchy = getHierarchy(entityID);
+		hierarchy->parent = parent;
+		hierarchy->firstChild = firstChild;
+		hierarchy->nextSibling = nextSibling;
+	});
+	bHierarchyIsSorted = false;
+}
+
+// Places the entities with a component in order of their Morton codes (entities with the same code keep their order) within the IDs they use,
+// per entity group under implementation 3. Entities that haven't crossed cells can still be moved along to make room, and under REFAC 2 the
+// unowned pools of the placed entities' components are then sorted into entity order
+void ECS::placeMortonOrder([[maybe_unused]] CompID compID, vector<std::pair<uint64_t, EntityID>>& codes)
+{
+	std::sort(codes.begin(), codes.end());
+
+	vector<EntityID> order;
+	order.reserve(codes.size());
+	for (auto& code : codes)
+		order.push_back(code.second);
+
+	// The sorted entities keep the IDs they already use, so find their components now
+	CompMask compMask;
+	for (auto entityID : order)
+		compMask = compMask | entities[entityID].compMask;
+
+#if IMPL < 3
+
+	placeEntities(order);
+
+#elif IMPL == 3
+
+	// Before the first refactor there are no groups to keep intact
+	if (entityGroups.empty())
+		placeEntities(order);
+
+	// Each group's entities are placed back into its own range
+	for (auto* group : entityGroups)
+	{
+		if (!group->compMask.test(compID))
+			continue;
+
+		vector<EntityID> groupOrder;
+		for (auto entityID : order)
+			if (entityID >= group->startIndex && entityID < group->getNextIndex())
+				groupOrder.push_back(entityID);
+
+		placeEntities(groupOrder);
+	}
+
+#endif
+
+#if REFAC == 2
+
+	// Put the components of the sorted entities in the same order as the entities (owned components are ordered by their group)
+	(compMask & componentDataMask).forEach([&](CompID i)
+	{
+		if (!componentOwningGroups[i])
+			sortComponentPool(i);
+	});
+
+#endif
+}
+
+// Removes an entity from the hierarchy's links, its children become roots
+void ECS::detachFromHierarchy(EntityID entityID)
+{
+	removeParent(entityID);
+
+	auto* hierarchy = getHierarchy(entityID);
+	for (EntityID child = hierarchy->firstChild; child != ecs::Hierarchy::none;)
+	{
+		auto* childHierarchy = getHierarchy(child);
+		const EntityID nextSibling = childHierarchy->nextSibling;
+		childHierarchy->parent = ecs::Hierarchy::none;
+		childHierarchy->nextSibling = ecs::Hierarchy::none;
+		updateHierarchyDepths(child);
+		child = nextSibling;
+	}
+	hierarchy->firstChild = ecs::Hierarchy::none;
+
+	bHierarchyIsSorted = false;
+}
+
+// Sets the depth of an entity and all of its descendants from its parent's depth (without recursion)
+void ECS::updateHierarchyDepths(EntityID entityID)
+{
+	vector<EntityID> stack = { entityID };
+	while (!stack.empty())
+	{
+		auto* hierarchy = getHierarchy(stack.back());
+		stack.pop_back();
+
+		hierarchy->depth = hierarchy->parent == ecs::Hierarchy::none ? 0 : getHierarchy(hierarchy->parent)->depth + 1;
+		for (EntityID child = hierarchy->firstChild; child != ecs::Hierarchy::none; child = getHierarchy(child)->nextSibling)
+			stack.push_back(child);
+	}
+}
+
+// Fixes the hierarchy links after the entities at a and b have switched IDs (or one has been transferred from a to b)
+// The entities' comp masks must already be at their new IDs
+void ECS::relinkHierarchy(EntityID a, EntityID b)
+{
+	if (bDeferRelink || (!inHierarchy(a) && !inHierarchy(b)))
+		return;
+
+	// Links hold the old IDs, so a link to a now means b and vice versa
+	auto remap = [&](EntityID entityID) { return entityID == a ? b : entityID == b ? a : entityID; };
+
+	// Find every entity that could link to either moved entity: the moved entities, their parents, their parents' children and their own children
+	vector<EntityID> linked;
+	for (auto entityID : { a, b })
+	{
+		if (!inHierarchy(entityID))
+			continue;
+
+		linked.push_back(entityID);
+		const auto* hierarchy = readHierarchy(entityID);
+
+		const EntityID parent = remap(hierarchy->parent);
+		if (parent != ecs::Hierarchy::none)
+		{
+			linked.push_back(parent);
+			for (EntityID sibling = remap(readHierarchy(parent)->firstChild); sibling != ecs::Hierarchy::none; sibling = remap(readHierarchy(sibling)->nextSibling))
+				linked.push_back(sibling);
+		}
+
+		for (EntityID child = remap(hierarchy->firstChild); child != ecs::Hierarchy::none; child = remap(readHierarchy(child)->nextSibling))
+			linked.push_back(child);
+	}
+
+	// Remap each entity's links exactly once, only stamping the ones that change
+	std::sort(linked.begin(), linked.end());
+	linked.erase(std::unique(linked.begin(), linked.end()), linked.end());
+	for (auto entityID : linked)
+	{
+		const auto* links = readHierarchy(entityID);
+		const EntityID parent = remap(links->parent), firstChild = remap(links->firstChild), nextSibling = remap(links->nextSibling);
+		if (parent == links->parent && firstChild == links->firstChild && nextSibling == links->nextSibling)
+			continue;
+
+		auto* hierarchy = getHierarchy(entityID);
+		hierarchy->parent = parent;
+		hierarchy->firstChild = firstChild;
+		hierarchy->nextSibling = nextSibling;
+	}
+
+	bHierarchyIsSorted = false;
+}
+
+// Enables a component of an entity if it's disabled
+void ECS::enableCompByID(CompID compID, EntityID entityID)
+{
+	if (!entities[entityID].disabledMask.test(compID))
+		return;
+
+	touchEntity(entityID);
+	entities[entityID].disabledMask.set(compID, false);
+	if (--disabledCounts[compID] == 0)
+		disabledCompMask.set(compID, false);
+}
+
+// Enables every disabled component of an entity, used when it's destroyed
+void ECS::enableAllComps(EntityID entityID)
+{
+	const CompMask disabledMask = entities[entityID].disabledMask;
+	disabledMask.forEach([&](CompID i)
+	{
+		enableCompByID(i, entityID);
+	});
+}
+
+// Keeps the queued add events pointing at an entity that is being moved (the entity's comp mask must not have been moved yet)
+void ECS::moveQueuedEvents(EntityID from, EntityID to)
+{
+	(entities[from].compMask & observedMask).forEach([&](CompID i)
+	{
+		componentEvents[i].move(from, to);
+	});
+}
+
+// Keeps the queued add events pointing at two entities that are being switched
+void ECS::switchQueuedEvents(EntityID a, EntityID b)
+{
+	((entities[a].compMask | entities[b].compMask) & observedMask).forEach([&](CompID i)
+	{
+		componentEvents[i].switch_(a, b);
+	});
+}
+
+// Returns one past the last alive entity, the entities after it are all dead
+size_t ECS::getEntityEnd()
+{
+	size_t end = entities.size();
+	while (end > 0 && entities[end - 1].compMask.none())
+		end--;
+	return end;
+}
+
+// The snapshot (or diff) header of this ECS, snapshots are only loaded if their header matches
+ecs::SnapshotHeader ECS::getSnapshotHeader(const char* magic)
+{
+	ecs::SnapshotHeader header;
+	memcpy(header.magic, magic, sizeof(header.magic));
+	header.noOfComponents = (uint32_t)componentPools.size();
+	return header;
+}
+
+// Writes a snapshot's blocks straight to a stream
+struct StreamSnapshotSink : ecs::SnapshotSink
+{
+	StreamSnapshotSink(std::ostream& stream) : stream(stream) {}
+
+	void write(const void* data, size_t bytes, size_t) override { stream.write(static_cast<const char*>(data), bytes); }
+
+	std::ostream& stream;
+};
+
+// Writes the world as raw blocks, each pool's live components are written in one go (the whole dense array under REFAC 2, up to the last alive entity under REFAC 1)
+// Singletons, indices, queued reactive events and which systems have run aren't written, they belong to the ECS rather than the world
+bool ECS::saveSnapshot(std::ostream& stream, bool bMappable)
+{
+	StreamSnapshotSink sink(stream);
+	writeSnapshot(sink, bMappable);
+	return stream.good();
+}
+
+void ECS::writeSnapshot(ecs::SnapshotSink& sink, bool bMappable)
+{
+	size_t position = 0;	// The number of bytes written, the stream doesn't need to be seekable
+	auto write = [&](const void* data, size_t bytes, size_t stride = 1) { sink.write(data, bytes, stride); position += bytes; };
+	auto writeValue = [&](const auto& value) { write(&value, sizeof(value)); };
+
+	// 64KB is a multiple of the page size (and allocation granularity) of the common platforms
+	auto header = getSnapshotHeader();
+	header.blockAlignment = bMappable ? 65536 : 1;
+
+	// Pads the snapshot to the start of the next block
+	auto align = [&]()
+	{
+		static const char zeros[4096] = {};
+		for (size_t padding = (header.blockAlignment - position % header.blockAlignment) % header.blockAlignment; padding > 0;)
+		{
+			const size_t bytes = std::min(padding, sizeof(zeros));
+			write(zeros, bytes);
+			padding -= bytes;
+		}
+	};
+
+	// Header, then the size of each component (0 for tags) so a loader with different components is caught
+	writeValue(header);
+	for (size_t i = 0; i < componentPools.size(); i++)
+		writeValue(uint64_t(componentPools[i] ? componentPools[i]->elementSize : 0));
+
+	// Entities
+	const size_t entityEnd = getEntityEnd();
+	writeValue(noOfEntities);
+	writeValue(uint64_t(entityEnd));
+	write(entities.data(), entityEnd * sizeof(ecs::EntityDesignation), sizeof(ecs::EntityDesignation));
+	writeValue(currentTick);
+	writeValue(bHierarchyIsSorted);
+
+#if IMPL == 3
+
+	writeValue(uint64_t(entityGroups.size()));
+	for (auto* group : entityGroups)
+		writeValue(*group);
+
+#endif
+
+#if REFAC == 2
+
+	writeValue(uint64_t(owningGroups.size()));
+	for (auto* group : owningGroups)
+		writeValue(*group);
+
+#endif
+
+	// Component pools
+	componentDataMask.forEach([&](CompID i)
+	{
+#if REFAC == 1
+
+		const size_t noOfComponents = entityEnd;
+
+#elif REFAC == 2
+
+		// The sparse arrays are rebuilt from the dense array when loading
+		const auto& dense = componentSparseSets[i]->dense;
+		const size_t noOfComponents = dense.size();
+		writeValue(uint64_t(noOfComponents));
+		write(dense.data(), noOfComponents * sizeof(EntityID), sizeof(EntityID));
+
+#endif
+
+		align();
+		write(componentPools[i]->data, noOfComponents * componentPools[i]->elementSize, componentPools[i]->elementSize);
+		align();
+		write(componentPools[i]->ticks, noOfComponents * sizeof(Tick), sizeof(Tick));
+	});
+
+	// Buffers' overflow storage
+	writeValue(uint64_t(bufferArena.data.size()));
+	write(bufferArena.data.data(), bufferArena.data.size());
+}
+
+// Replaces the world with one written by saveSnapshot, returning false if the snapshot doesn't match this ECS (or can't be read)
+// The current entities are dropped without queuing remove events, the indices are rebuilt and any queued reactive events are cleared
+// A snapshot that doesn't match leaves the world as it was, a failed read part way through leaves it empty
+bool ECS::loadSnapshot(std::istream& stream)
+{
+	return readSnapshot(stream, -1);
+}
+
+// Reads a stream from memory without copying it, so skipping over a mapped snapshot's pools doesn't touch their pages
+struct MemoryStreamBuffer : std::streambuf
+{
+	MemoryStreamBuffer(char* data, size_t bytes) { setg(data, data, data + bytes); }
+
+	pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode) override
+	{
+		char* target = (direction == std::ios_base::beg ? eback() : direction == std::ios_base::cur ? gptr() : egptr()) + offset;
+		if (target < eback() || target > egptr())
+			return pos_type(off_type(-1));
+
+		setg(eback(), target, egptr());
+		return pos_type(target - eback());
+	}
+};
+
+#ifdef ECS_SNAPSHOT_MMAP
+
+void ecs::unmapMemory(void* data, size_t bytes)
+{
+	munmap(data, bytes);
+}
+
+// Loads a snapshot saved with bMappable set, the pools are mapped from the file and the rest is read as usual
+bool ECS::mapSnapshot(const std::string& path)
+{
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file == -1)
+		return false;
+
+	// Map the whole file to read everything but the pools, the pools get their own mappings so this is unmapped afterwards
+	struct stat fileInfo;
+	void* view = fstat(file, &fileInfo) == 0 && fileInfo.st_size > 0 ? mmap(0, (size_t)fileInfo.st_size, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+	if (view == MAP_FAILED)
+	{
+		close(file);
+		return false;
+	}
+
+	MemoryStreamBuffer buffer(static_cast<char*>(view), (size_t)fileInfo.st_size);
+	std::istream stream(&buffer);
+	const bool bLoaded = readSnapshot(stream, file);
+
+	munmap(view, (size_t)fileInfo.st_size);
+	close(file);
+	return bLoaded;
+}
+
+// Maps bytes of a snapshot file over the start of a new zeroed region of capacity bytes, copy on write. Returns null if it fails
+static byte* mapSnapshotBlock(int file, size_t offset, size_t bytes, size_t capacity)
+{
+	const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	auto roundUp = [&](size_t value) { return (value + pageSize - 1) / pageSize * pageSize; };
+
+	void* region = mmap(0, roundUp(capacity), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED)
+		return 0;
+
+	// The end of the last page is the padding before the next block, or past the end of the file which maps as zeros
+	if (bytes && mmap(region, roundUp(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file, (off_t)offset) == MAP_FAILED)
+	{
+		munmap(region, roundUp(capacity));
+		return 0;
+	}
+
+	return static_cast<byte*>(region);
+}
+
+#endif
+
+// Reads bytes from a stream into a vector, growing it as the bytes arrive so a corrupt size can't make it allocate more than the stream holds
+static bool readBlock(std::istream& stream, vector<byte>& data, uint64_t bytes)
+{
+	data.clear();
+	while (data.size() < bytes)
+	{
+		const size_t offset = data.size();
+		const size_t chunk = (size_t)std::min<uint64_t>(bytes - offset, 1 << 20);
+		data.resize(offset + chunk);
+		if (!stream.read(reinterpret_cast<char*>(data.data() + offset), chunk))
+			return false;
+	}
+	return true;
+}
+
+// Reads a snapshot, if mappedFile is a file descriptor (not -1) the stream is that file and the pools are mapped from it rather than read
+bool ECS::readSnapshot(std::istream& stream, int mappedFile)
+{
+	size_t position = 0;	// The number of bytes read
+	auto read = [&](void* data, size_t bytes) { stream.read(static_cast<char*>(data), bytes); position += bytes; return stream.good(); };
+	auto readValue = [&](auto& value) { return read(&value, sizeof(value)); };
+	auto skip = [&](size_t bytes)
+	{
+		// A mapped file is seeked past so the skipped pages are never touched
+		if (mappedFile != -1)
+			stream.seekg((std::streamoff)bytes, std::ios_base::cur);
+		else
+			stream.ignore((std::streamsize)bytes);
+		position += bytes;
+		return stream.good();
+	};
+
+	// Check the snapshot was written by an ECS like this one
+	ecs::SnapshotHeader header;
+	if (!readValue(header) || !header.matches(getSnapshotHeader()) || header.blockAlignment == 0)
+		return false;
+	auto align = [&]() { return skip((header.blockAlignment - position % header.blockAlignment) % header.blockAlignment); };
+
+#ifdef ECS_SNAPSHOT_MMAP
+
+	// The blocks must start on page boundaries to be mapped
+	if (mappedFile != -1 && header.blockAlignment % (uint32_t)sysconf(_SC_PAGESIZE) != 0)
+		return false;
+
+#endif
+
+	for (size_t i = 0; i < componentPools.size(); i++)
+	{
+		uint64_t elementSize = 0;
+		if (!readValue(elementSize) || elementSize != (componentPools[i] ? componentPools[i]->elementSize : 0))
+			return false;
+	}
+
+	// Empties the world, killing the entities before end
+	auto clearWorld = [&](size_t end)
+	{
+		std::fill(entities.begin(), entities.begin() + end, ecs::EntityDesignation());
+		noOfEntities = 0;
+
+#if IMPL == 3
+
+		for (auto ptr : entityGroups)
+			delete ptr;
+		entityGroups.clear();
+
+#endif
+
+#if REFAC == 2
+
+		for (auto* sparseSet : componentSparseSets)
+		{
+			if (!sparseSet)
+				continue;
+			for (auto* page : sparseSet->pages)
+				delete page;
+			sparseSet->pages.clear();
+			sparseSet->dense.clear();
+		}
+
+		// The groups stay (the pointers from group<>() remain valid), they're packed again once the components are loaded
+		for (auto* group : owningGroups)
+			group->size = 0;
+		defragmentCursor = 0;
+
+#endif
+	};
+
+	// Drop the current entities, cleaning up what isn't simply overwritten
+	const size_t oldEntityEnd = getEntityEnd();
+	for (size_t id = 0; id < oldEntityEnd; id++)
+	{
+		const CompMask compMask = entities[id].compMask;
+		unindexComponents(compMask, (EntityID)id);
+		(compMask & runtimeDestroyMask).forEach([&](CompID i)
+		{
+			runtimeComponents[i].destroy(componentPools[i]->get(getComponentIndex(i, (EntityID)id)));
+		});
+	}
+	clearWorld(oldEntityEnd);
+	for (auto& events : componentEvents)
+		events = ecs::ComponentEvents();
+
+	// Entities
+	EntityID savedNoOfEntities = 0;
+	uint64_t entityEnd = 0;
+	if (!readValue(savedNoOfEntities) || !readValue(entityEnd) || entityEnd > entities.size())
+		return false;
+	if (!read(entities.data(), (size_t)entityEnd * sizeof(ecs::EntityDesignation)))
+	{
+		clearWorld((size_t)entityEnd);
+		return false;
+	}
+	noOfEntities = savedNoOfEntities;
+
+	// Keep the tick moving forward, past the systems that have already run here
+	Tick savedTick = 0;
+	readValue(savedTick);
+	currentTick = std::max(currentTick, savedTick) + 1;
+	readValue(bHierarchyIsSorted);
+
+#if IMPL == 3
+
+	uint64_t noOfGroups = 0;
+	readValue(noOfGroups);
+	for (uint64_t i = 0; i < noOfGroups && stream.good(); i++)
+	{
+		auto* group = new ecs::EntityGroup();
+		readValue(*group);
+		entityGroups.push_back(group);
+	}
+
+#endif
+
+#if REFAC == 2
+
+	// This ECS keeps its own owning groups, the saved ones only ordered the saved dense arrays
+	uint64_t noOfOwningGroups = 0;
+	readValue(noOfOwningGroups);
+	for (uint64_t i = 0; i < noOfOwningGroups && stream.good(); i++)
+	{
+		ecs::OwningGroup group;
+		readValue(group);
+	}
+
+#endif
+
+	// Component pools
+	componentDataMask.forEach([&](CompID i)
+	{
+#if REFAC == 1
+
+		const size_t noOfComponents = (size_t)entityEnd;
+
+#elif REFAC == 2
+
+		// Read the dense array, then point each owner back at its component
+		auto* sparseSet = componentSparseSets[i];
+		uint64_t noOfComponents = 0;
+		if (!readValue(noOfComponents) || noOfComponents > MAX_ENTITIES)
+			return;
+		sparseSet->dense.resize((size_t)noOfComponents);
+		if (!read(sparseSet->dense.data(), (size_t)noOfComponents * sizeof(EntityID)))
+			return;
+		for (size_t j = 0; j < sparseSet->dense.size(); j++)
+		{
+			sparseSet->emplace(sparseSet->dense[j]);
+			sparseSet->index(sparseSet->dense[j]) = (EntityID)j;
+		}
+
+#endif
+
+		auto* pool = componentPools[i];
+		const size_t dataBytes = (size_t)noOfComponents * pool->elementSize;
+		const size_t tickBytes = (size_t)noOfComponents * sizeof(Tick);
+
+#ifdef ECS_SNAPSHOT_MMAP
+
+		if (mappedFile != -1)
+		{
+			// Map the blocks over new pools of the full capacity, the components after the loaded ones start zeroed
+			if (!align())
+				return;
+			byte* data = mapSnapshotBlock(mappedFile, position, dataBytes, pool->elementSize * MAX_ENTITIES);
+			if (!data || !skip(dataBytes) || !align())
+			{
+				if (data)
+					munmap(data, pool->elementSize * MAX_ENTITIES);
+				stream.setstate(std::ios_base::failbit);
+				return;
+			}
+			byte* ticks = mapSnapshotBlock(mappedFile, position, tickBytes, sizeof(Tick) * MAX_ENTITIES);
+			if (!ticks || !skip(tickBytes))
+			{
+				munmap(data, pool->elementSize * MAX_ENTITIES);
+				if (ticks)
+					munmap(ticks, sizeof(Tick) * MAX_ENTITIES);
+				stream.setstate(std::ios_base::failbit);
+				return;
+			}
+
+			pool->adoptMapping(data, pool->elementSize * MAX_ENTITIES, reinterpret_cast<Tick*>(ticks), sizeof(Tick) * MAX_ENTITIES);
+			return;
+		}
+
+#endif
+
+		align();
+		read(pool->data, dataBytes);
+		align();
+		read(pool->ticks, tickBytes);
+	});
+
+	// Buffers' overflow storage
+	uint64_t arenaSize = 0;
+	if (readValue(arenaSize))
+		readBlock(stream, bufferArena.data, arenaSize);
+
+	// Leave an empty world rather than a partly loaded one (the runtime components weren't constructed here, so they aren't destroyed)
+	if (!stream.good())
+	{
+		clearWorld((size_t)entityEnd);
+		return false;
+	}
+
+#if REFAC == 2
+
+	for (auto* group : owningGroups)
+		packOwningGroup(group);
+
+#endif
+
+	// Every entity slot and component may have changed. The loaded components keep their saved ticks, which may be older than the systems'
+	// last runs here, so they count as written on this tick instead
+	std::fill(entityTicks.begin(), entityTicks.begin() + std::max(oldEntityEnd, (size_t)entityEnd), currentTick);
+	loadTick = currentTick;
+
+	// Count the disabled components again
+	std::fill(disabledCounts.begin(), disabledCounts.end(), 0);
+	disabledCompMask.reset();
+	for (size_t id = 0; id < entityEnd; id++)
+		entities[id].disabledMask.forEach([&](CompID i)
+		{
+			disabledCounts[i]++;
+			disabledCompMask.set(i);
+		});
+
+	// Rebuild the indices, the values are read the next time each index is searched
+	for (auto* index : componentIndices)
+		forEachEntityWithComponent(index->compID, [&](EntityID entityID) { index->addLater(entityID); });
+
+	return true;
+}
+
+// Writes the changes since a tick (see the declaration) and returns the tick to pass to the next diff
+// The tick is advanced, so writes after the diff are stamped after the returned tick
+Tick ECS::diffSnapshot(std::ostream& stream, Tick sinceTick)
+{
+	auto write = [&](const void* data, size_t bytes) { stream.write(static_cast<const char*>(data), bytes); };
+	auto writeValue = [&](const auto& value) { write(&value, sizeof(value)); };
+
+	writeValue(getSnapshotHeader("ECSD"));
+	for (size_t i = 0; i < componentPools.size(); i++)
+		writeValue(uint64_t(componentPools[i] ? componentPools[i]->elementSize : 0));
+
+	writeValue(noOfEntities);
+
+#if IMPL == 3
+
+	// The group table is small, so it's always written whole
+	writeValue(uint64_t(entityGroups.size()));
+	for (auto* group : entityGroups)
+		writeValue(*group);
+
+#endif
+
+	// Each changed entity is its ID, its masks, the components written and then their data
+	bool bBuffersChanged = false;
+	for (size_t id = 0; id < entities.size(); id++)
+	{
+		const CompMask dataMask = entities[id].compMask & componentDataMask;
+
+		// A moved entity's components were all written to its new ID
+		CompMask writtenMask;
+		if (entityTicks[id] > sinceTick)
+			writtenMask = dataMask;
+		else if (dataMask.any())
+		{
+			dataMask.forEach([&](CompID i)
+			{
+				if (componentPools[i]->ticks[getComponentIndex(i, (EntityID)id)] > sinceTick)
+					writtenMask.set(i);
+			});
+			if (writtenMask.none())
+				continue;
+		}
+		else
+			continue;
+
+		writeValue(uint8_t(1));
+		writeValue(EntityID(id));
+		writeValue(entities[id]);
+		writeValue(writtenMask);
+		writtenMask.forEach([&](CompID i)
+		{
+			write(componentPools[i]->get(getComponentIndex(i, (EntityID)id)), componentPools[i]->elementSize);
+		});
+
+		if ((writtenMask & bufferCompMask).any())
+			bBuffersChanged = true;
+	}
+	writeValue(uint8_t(0));
+
+	// The buffers' overflow storage is written whole if any buffer has changed. The blocks of unchanged buffers haven't moved (moving one
+	// stamps its component) so they're still valid in the new arena
+	writeValue(uint8_t(bBuffersChanged));
+	if (bBuffersChanged)
+	{
+		writeValue(uint64_t(bufferArena.data.size()));
+		write(bufferArena.data.data(), bufferArena.data.size());
+	}
+
+	return currentTick++;
+}
+
+// Applies a diff written by diffSnapshot, the changed entities are updated as if their components had been assigned, removed and written
+// here (so reactive systems, indices and Changed<T> see them). Returns false if the diff doesn't match this ECS or is cut short, which may
+// leave it part applied
+bool ECS::applySnapshotDiff(std::istream& stream)
+{
+	auto read = [&](void* data, size_t bytes) { stream.read(static_cast<char*>(data), bytes); return stream.good(); };
+	auto readValue = [&](auto& value) { return read(&value, sizeof(value)); };
+
+	ecs::SnapshotHeader header;
+	if (!readValue(header) || !header.matches(getSnapshotHeader("ECSD")))
+		return false;
+	for (size_t i = 0; i < componentPools.size(); i++)
+	{
+		uint64_t elementSize = 0;
+		if (!readValue(elementSize) || elementSize != (componentPools[i] ? componentPools[i]->elementSize : 0))
+			return false;
+	}
+
+	EntityID savedNoOfEntities = 0;
+	if (!readValue(savedNoOfEntities))
+		return false;
+
+	// The components this ECS has, an entry can't use any others
+	CompMask registeredMask;
+	for (size_t i = 0; i < componentPools.size(); i++)
+		registeredMask.set(i);
+
+#if IMPL == 3
+
+	uint64_t noOfGroups = 0;
+	if (!readValue(noOfGroups))
+		return false;
+	vector<ecs::EntityGroup*> groups;
+	for (uint64_t i = 0; i < noOfGroups; i++)
+	{
+		ecs::EntityGroup group;
+		if (!readValue(group))
+		{
+			for (auto* ptr : groups)
+				delete ptr;
+			return false;
+		}
+		groups.push_back(new ecs::EntityGroup(group));
+	}
+	for (auto* ptr : entityGroups)
+		delete ptr;
+	entityGroups = groups;
+
+#endif
+
+	for (;;)
+	{
+		uint8_t bEntity = 0;
+		if (!readValue(bEntity))
+			return false;
+		if (!bEntity)
+			break;
+
+		EntityID id = 0;
+		ecs::EntityDesignation designation;
+		CompMask writtenMask;
+		if (!readValue(id) || !readValue(designation) || !readValue(writtenMask))
+			return false;
+
+		// Check the entry before changing anything, only data components the entity now has can be written
+		if ((size_t)id >= entities.size() || (designation.compMask & ~registeredMask).any() || (designation.disabledMask & ~designation.compMask).any() ||
+			(writtenMask & ~(designation.compMask & componentDataMask)).any())
+			return false;
+
+		const CompMask oldMask = entities[id].compMask;
+		const CompMask removedMask = oldMask & ~designation.compMask;
+		const CompMask addedMask = designation.compMask & ~oldMask;
+
+		// Take out the removed components, as unassignComp does
+		unindexComponents(removedMask, id);
+		(removedMask & runtimeDestroyMask).forEach([&](CompID i)
+		{
+			runtimeComponents[i].destroy(componentPools[i]->get(getComponentIndex(i, id)));
+		});
+		removedMask.forEach([&](CompID i)
+		{
+			queueRemovedEvent(i, id);
+
+#if REFAC == 2
+
+			if (componentDataMask.test(i))
+				removeFromSparseSet(i, id);
+
+#endif
+		});
+		entities[id].compMask = oldMask & designation.compMask;
+
+		// Add the new components one at a time, as assignComp does, so owning groups only take the entity once it has all of their components
+		addedMask.forEach([&](CompID i)
+		{
+			queueAddedEvent(i, id);
+			entities[id].compMask.set(i);
+
+#if REFAC == 2
+
+			if (componentDataMask.test(i))
+				addToSparseSet(i, id);
+
+#endif
+
+			if (indexedCompMask.test(i))
+				indexComponent(i, id);
+		});
+
+		// Swap in the new disabled mask
+		entities[id].disabledMask.forEach([&](CompID i)
+		{
+			if (--disabledCounts[i] == 0)
+				disabledCompMask.set(i, false);
+		});
+		entities[id].disabledMask = designation.disabledMask;
+		entities[id].disabledMask.forEach([&](CompID i)
+		{
+			if (disabledCounts[i]++ == 0)
+				disabledCompMask.set(i);
+		});
+
+		// Read the written components, stamping them as written here
+		bool bRead = true;
+		writtenMask.forEach([&](CompID i)
+		{
+			auto* pool = componentPools[i];
+			const size_t compIndex = getComponentIndex(i, id);
+			bRead = bRead && read(pool->get(compIndex), pool->elementSize);
+			pool->ticks[compIndex] = currentTick;
+			if (indexedCompMask.test(i))
+				markIndexedComponentDirty(i, id);
+		});
+		if (!bRead)
+			return false;
+
+		touchEntity(id);
+		if (hierarchyCompID != -1 && (removedMask | addedMask | writtenMask).test((CompID)hierarchyCompID))
+			bHierarchyIsSorted = false;
+	}
+	noOfEntities = savedNoOfEntities;
+
+	uint8_t bBuffersChanged = 0;
+	if (!readValue(bBuffersChanged))
+		return false;
+	if (bBuffersChanged)
+	{
+		uint64_t arenaSize = 0;
+		if (!readValue(arenaSize) || !readBlock(stream, bufferArena.data, arenaSize))
+			return false;
+	}
+
+	return true;
+}
+
+// Runs task(i) for each i below count, spread across the hardware threads if the tasks cover enough bytes to be worth starting them
+template<class F> static void runInParallel(size_t count, size_t bytes, F task)
+{
+	if (count < 2 || bytes < (1 << 20))
+	{
+		for (size_t i = 0; i < count; i++)
+			task(i);
+		return;
+	}
+
+	std::atomic<size_t> next = 0;
+	auto work = [&]()
+	{
+		for (size_t i = next++; i < count; i = next++)
+			task(i);
+	};
 
-ECS::ECS()
+	const size_t noOfThreads = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+	vector<std::thread> threads;
+	for (size_t i = 1; i < noOfThreads; i++)
+		threads.emplace_back(work);
+	work();
+	for (auto& thread : threads)
+		thread.join();
+}
+
+// Collects a snapshot in memory, starting a new block for each column (the loose values between them are gathered into one block)
+struct FrameSnapshotSink : ecs::SnapshotSink
 {
+	void write(const void* data, size_t bytes, size_t stride) override
+	{
+		if (stride != 1 || strides.empty() || strides.back() != 1)
+		{
+			blockStarts.push_back(frame.size());
+			strides.push_back(stride);
+		}
+		frame.insert(frame.end(), static_cast<const byte*>(data), static_cast<const byte*>(data) + bytes);
+	}
+
+	vector<byte> frame;
+	vector<size_t> blockStarts;
+	vector<size_t> strides;
+};
 
+static void writeVarint(vector<byte>& out, uint64_t value)
+{
+	for (; value >= 0x80; value >>= 7)
+		out.push_back(byte(value | 0x80));
+	out.push_back(byte(value));
 }
 
-ECS::~ECS()
+static bool readVarint(const byte*& in, const byte* end, uint64_t& value)
 {
-	for (auto ptr : componentPools)
+	value = 0;
+	for (unsigned shift = 0; in < end && shift < 64; shift += 7)
 	{
-		delete ptr;
-		ptr = 0;
+		const byte next = *in++;
+		value |= uint64_t(next & 0x7f) << shift;
+		if (!(next & 0x80))
+			return true;
 	}
-	componentPools.clear();
+	return false;
+}
 
-#if REFAC == 2
+// Encodes a block: XOR it against the last frame's block (zeros past its end), shuffle the bytes of its elements together, then run length encode it
+// Each run is a varint of its length shifted up by one, with the bottom bit set for a repeated byte (followed by the byte) or clear for literal bytes
+static void encodeSnapshotBlock(const byte* data, size_t bytes, size_t stride, const byte* last, size_t lastBytes, vector<byte>& encoded)
+{
+	const size_t noOfElements = bytes / stride;
+	vector<byte> shuffled(bytes);
+	for (size_t element = 0, i = 0; element < noOfElements; element++)
+		for (size_t b = 0; b < stride; b++, i++)
+			shuffled[b * noOfElements + element] = data[i] ^ (i < lastBytes ? last[i] : 0);
+
+	size_t literalStart = 0;
+	auto writeLiterals = [&](size_t end)
+	{
+		if (end == literalStart)
+			return;
+		writeVarint(encoded, uint64_t(end - literalStart) << 1);
+		encoded.insert(encoded.end(), shuffled.begin() + literalStart, shuffled.begin() + end);
+	};
 
-	for (auto ptr : componentSparseSets)
+	for (size_t i = 0; i < bytes;)
 	{
-		delete ptr;
-		ptr = 0;
+		size_t run = 1;
+		while (i + run < bytes && shuffled[i + run] == shuffled[i])
+			run++;
+
+		// Short runs are cheaper left amongst the literals
+		if (run >= 4)
+		{
+			writeLiterals(i);
+			writeVarint(encoded, uint64_t(run) << 1 | 1);
+			encoded.push_back(shuffled[i]);
+			literalStart = i + run;
+		}
+		i += run;
 	}
-	componentSparseSets.clear();
+	writeLiterals(bytes);
+}
 
-	for (auto ptr : componentAvailabilityBitsets)
+// Reverses encodeSnapshotBlock into data, returning false if the encoding is corrupt
+static bool decodeSnapshotBlock(const byte* encoded, size_t encodedBytes, size_t stride, const byte* last, size_t lastBytes, byte* data, size_t bytes)
+{
+	vector<byte> shuffled(bytes);
+	const byte* in = encoded;
+	const byte* end = encoded + encodedBytes;
+	for (size_t i = 0; i < bytes;)
 	{
-		delete ptr;
-		ptr = 0;
+		uint64_t run = 0;
+		if (!readVarint(in, end, run))
+			return false;
+
+		const uint64_t length = run >> 1;
+		if (length == 0 || length > bytes - i)
+			return false;
+
+		if (run & 1)
+		{
+			if (in == end)
+				return false;
+			memset(&shuffled[i], *in++, (size_t)length);
+		}
+		else
+		{
+			if (length > uint64_t(end - in))
+				return false;
+			memcpy(&shuffled[i], in, (size_t)length);
+			in += length;
+		}
+		i += (size_t)length;
 	}
-	componentAvailabilityBitsets.clear();
+	if (in != end)
+		return false;
+
+	const size_t noOfElements = bytes / stride;
+	for (size_t element = 0, i = 0; element < noOfElements; element++)
+		for (size_t b = 0; b < stride; b++, i++)
+			data[i] = shuffled[b * noOfElements + element] ^ (i < lastBytes ? last[i] : 0);
+	return true;
+}
 
-#endif
+// Writes the snapshot saveSnapshot would, with each block encoded against the same block of the history's frame and the history replaced by this frame
+// The header is followed by whether the frame was encoded against the history (not if there's none, or it has a different number of blocks),
+// the number of blocks, then each block's size, stride, encoded size and encoding
+bool ECS::saveCompressedSnapshot(std::ostream& stream, ecs::SnapshotHistory* history)
+{
+	FrameSnapshotSink sink;
+	writeSnapshot(sink, false);
+	sink.blockStarts.push_back(sink.frame.size());
+	const size_t noOfBlocks = sink.strides.size();
+
+	const bool bDelta = history && history->blockStarts.size() == sink.blockStarts.size();
+	vector<vector<byte>> encoded(noOfBlocks);
+	runInParallel(noOfBlocks, sink.frame.size(), [&](size_t i)
+	{
+		const byte* last = bDelta ? history->frame.data() + history->blockStarts[i] : 0;
+		const size_t lastBytes = bDelta ? history->blockStarts[i + 1] - history->blockStarts[i] : 0;
+		encodeSnapshotBlock(sink.frame.data() + sink.blockStarts[i], sink.blockStarts[i + 1] - sink.blockStarts[i], sink.strides[i], last, lastBytes, encoded[i]);
+	});
+
+	auto write = [&](const void* data, size_t bytes) { stream.write(static_cast<const char*>(data), bytes); };
+	auto writeValue = [&](const auto& value) { write(&value, sizeof(value)); };
+
+	writeValue(getSnapshotHeader("ECSC"));
+	writeValue(uint8_t(bDelta));
+	writeValue(uint64_t(noOfBlocks));
+	for (size_t i = 0; i < noOfBlocks; i++)
+	{
+		writeValue(uint64_t(sink.blockStarts[i + 1] - sink.blockStarts[i]));
+		writeValue(uint64_t(sink.strides[i]));
+		writeValue(uint64_t(encoded[i].size()));
+		write(encoded[i].data(), encoded[i].size());
+	}
 
-#if IMPL == 3
+	if (!stream.good())
+		return false;
 
-	for (auto ptr : sortingGroups)
+	if (history)
 	{
-		delete ptr;
-		ptr = 0;
+		history->frame = std::move(sink.frame);
+		history->blockStarts = std::move(sink.blockStarts);
 	}
-	sortingGroups.clear();
+	return true;
+}
 
-	for (auto ptr : entityGroups)
+// Loads a snapshot written by saveCompressedSnapshot (see loadSnapshot), a frame encoded against a history needs the history of the frame before it
+// The history is replaced by this frame if it loads
+bool ECS::loadCompressedSnapshot(std::istream& stream, ecs::SnapshotHistory* history)
+{
+	auto read = [&](void* data, size_t bytes) { stream.read(static_cast<char*>(data), bytes); return stream.good(); };
+	auto readValue = [&](auto& value) { return read(&value, sizeof(value)); };
+
+	ecs::SnapshotHeader header;
+	uint8_t bDelta = 0;
+	uint64_t noOfBlocks = 0;
+	if (!readValue(header) || !header.matches(getSnapshotHeader("ECSC")) || !readValue(bDelta) || !readValue(noOfBlocks))
+		return false;
+	if (bDelta && (!history || history->blockStarts.size() != noOfBlocks + 1))
+		return false;
+
+	// Read every block, then decode them together
+	vector<size_t> blockStarts(1, 0);
+	vector<size_t> strides;
+	vector<vector<byte>> encoded;
+	for (uint64_t i = 0; i < noOfBlocks; i++)
 	{
-		delete ptr;
-		ptr = 0;
+		uint64_t bytes = 0, stride = 0, encodedBytes = 0;
+		if (!readValue(bytes) || !readValue(stride) || !readValue(encodedBytes) || stride == 0 || bytes % stride != 0)
+			return false;
+		if (bytes > ECS_MAX_SNAPSHOT_BYTES - blockStarts.back())
+			return false;
+
+		// The encoding is read as it arrives so a corrupt size fails at the end of the stream rather than allocating it up front
+		encoded.emplace_back();
+		if (!readBlock(stream, encoded.back(), encodedBytes))
+			return false;
+
+		blockStarts.push_back(blockStarts.back() + (size_t)bytes);
+		strides.push_back((size_t)stride);
 	}
-	entityGroups.clear();
 
-#endif
+	vector<byte> frame(blockStarts.back());
+	std::atomic<bool> bDecoded = true;
+	runInParallel((size_t)noOfBlocks, frame.size(), [&](size_t i)
+	{
+		const byte* last = bDelta ? history->frame.data() + history->blockStarts[i] : 0;
+		const size_t lastBytes = bDelta ? history->blockStarts[i + 1] - history->blockStarts[i] : 0;
+		if (!decodeSnapshotBlock(encoded[i].data(), encoded[i].size(), strides[i], last, lastBytes, frame.data() + blockStarts[i], blockStarts[i + 1] - blockStarts[i]))
+			bDecoded = false;
+	});
+	if (!bDecoded)
+		return false;
+
+	MemoryStreamBuffer buffer(reinterpret_cast<char*>(frame.data()), frame.size());
+	std::istream frameStream(&buffer);
+	if (!readSnapshot(frameStream, -1))
+		return false;
+
+	if (history)
+	{
+		history->frame = std::move(frame);
+		history->blockStarts = std::move(blockStarts);
+	}
+	return true;
 }
 
-// This switches entities in the entity array and handles the switching of components (implementation and refactor dependant)
-void ECS::switchEntities(EntityID a, EntityID b)
+#ifdef ECS_FORK_COW
+
+void* ecs::mapMemory(size_t bytes)
 {
-	if (a == b)
-		return;
+	void* memory = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		throw std::bad_alloc();
+	return memory;
+}
 
-	// Switch all component data
-	switchComponents(a, b);
+void ecs::closeFile(int file)
+{
+	close(file);
+}
 
-	// Switch comp masks
-	const auto old = entities[a].compMask;
-	entities[a].compMask = entities[b].compMask;
-	entities[b].compMask = old;
+// Finds the pages of a private file mapping that have been written since it was mapped, returning false if the page map can't be read
+// A written page has been copied out of the file into an anonymous page, so it's present (bit 63) and not a file page (bit 61), or swapped out (bit 62)
+static bool findWrittenPages(const byte* memory, size_t noOfPages, vector<bool>& bWritten)
+{
+	const int pageMap = open("/proc/self/pagemap", O_RDONLY);
+	if (pageMap == -1)
+		return false;
+
+	const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	vector<uint64_t> pages(noOfPages);
+	const size_t bytes = noOfPages * sizeof(uint64_t);
+	const bool bRead = pread(pageMap, pages.data(), bytes, (off_t)(reinterpret_cast<uintptr_t>(memory) / pageSize * sizeof(uint64_t))) == (ssize_t)bytes;
+	close(pageMap);
+	if (!bRead)
+		return false;
+
+	bWritten.resize(noOfPages);
+	for (size_t i = 0; i < noOfPages; i++)
+		bWritten[i] = (pages[i] >> 62 & 1) || ((pages[i] >> 63 & 1) && !(pages[i] >> 61 & 1));
+	return true;
 }
 
-// This transfer an entity from one place to another (implementation and refactor dependant)
-void ECS::transferEntity(EntityID from, EntityID to)
+// Shares a mapped region of a pool (capacity bytes long, the first used bytes are live) with a fork, returning the fork's mapping (null if it fails)
+// The first time, the live bytes are written to a memfd and the region is remapped over itself as a private mapping of the file. The fork is another
+// private mapping of it, so each side only copies the pages it writes to. Later forks map the same file and copy the pages the parent has written
+// since, unless it has written most of them, when the region moves to a new file holding its current contents (the old file lives on in its forks)
+static byte* shareRegion(byte* memory, int& file, size_t capacity, size_t used)
 {
-	if (from == to)
-		return;
+	const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t noOfPages = (used + pageSize - 1) / pageSize;
 
-	// Transfer components
-	transferComponents(from, to);
+	vector<bool> bWritten;
+	if (file == -1 || !findWrittenPages(memory, noOfPages, bWritten) || (size_t)std::count(bWritten.begin(), bWritten.end(), true) * 2 > noOfPages)
+	{
+		const int newFile = memfd_create("ecs_pool", MFD_CLOEXEC);
+		bool bWrote = newFile != -1 && ftruncate(newFile, (off_t)capacity) == 0;
+		for (size_t written = 0; bWrote && written < used;)
+		{
+			const ssize_t bytes = pwrite(newFile, memory + written, used - written, (off_t)written);
+			bWrote = bytes > 0;
+			written += bWrote ? (size_t)bytes : 0;
+		}
 
-	// Set comp masks
-	entities[to].compMask = entities[from].compMask;
-	entities[from].compMask = 0;
+		// The file holds the same live bytes, so the region can be swapped for it in place (the dead bytes after them become zeros)
+		if (!bWrote || mmap(memory, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, newFile, 0) == MAP_FAILED)
+		{
+			if (newFile != -1)
+				close(newFile);
+			return 0;
+		}
+
+		if (file != -1)
+			close(file);
+		file = newFile;
+		bWritten.assign(noOfPages, false);
+	}
+
+	void* fork = mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	if (fork == MAP_FAILED)
+		return 0;
+
+	for (size_t i = 0; i < noOfPages; i++)
+		if (bWritten[i])
+			memcpy(static_cast<byte*>(fork) + i * pageSize, memory + i * pageSize, pageSize);
+	return static_cast<byte*>(fork);
 }
 
-// This Transfers all components from an entity to another and is optimized to ignore the old components
-// This is handy for whenever the old entity is about to be deleted etc (but is still implemmentation specific)
-void ECS::transferComponents(EntityID from, EntityID to)
+bool ecs::ComponentPool::share(ComponentPool& fork, size_t noOfComponents)
 {
-	if (from == to)
-		return;
-
-	// Loop through each possible component this entity could have
-	for (int i = 0; i < MAX_COMPONENTS; i++)
+	byte* forkData = shareRegion(data, dataFile, mappedDataBytes, noOfComponents * elementSize);
+	byte* forkTicks = forkData ? shareRegion(reinterpret_cast<byte*>(ticks), tickFile, mappedTickBytes, noOfComponents * sizeof(Tick)) : 0;
+	if (!forkTicks)
 	{
-		// NOTE, i is the compID which is deliberately fixed as such when the components were created with initComponents<>()
+		if (forkData)
+			munmap(forkData, mappedDataBytes);
+		return false;
+	}
 
-		// Check component pool exists
-		if (i >= componentPools.size())
-			break;
+	fork.adoptMapping(forkData, mappedDataBytes, reinterpret_cast<Tick*>(forkTicks), mappedTickBytes);
+	return true;
+}
 
-		// Check entity has this component
-		if (!entities[from].compMask.test(i))
-			continue;
+#endif
+
+// Copies the ECS, sharing its pools' live components with the fork copy on write (or copying them if that isn't available or fails)
+// The pools are the only part that's large, the rest of the ECS is copied as is with its owned objects (sparse sets, groups and indices) duplicated
+unique_ptr<ECS> ECS::fork()
+{
+	auto fork = std::make_unique<ECS>();
 
+	// Entities
+	fork->entities = entities;
+	fork->entityTicks = entityTicks;
+	fork->noOfEntities = noOfEntities;
+
+	// Component pools
 #if REFAC == 1
 
-		// This method requires all component data is copied from one location to another in the components arrays
-		// Directly transfer component data across
-		componentPools[i]->copy(from, to);
+	const size_t entityEnd = getEntityEnd();
+
+#endif
+	fork->componentPools.resize(componentPools.size(), 0);
+	fork->componentDataMask = componentDataMask;
+	componentDataMask.forEach([&](CompID i)
+	{
+#if REFAC == 1
+
+		const size_t noOfComponents = entityEnd;
 
 #elif REFAC == 2
 
-		// This method only requires the changing of an integer in each component sparse set
-		// The entityID has moved so we must tell it in the new sparse set location where it's component is (the old sparse set location's element)
-		componentSparseSets[i]->at(to) = componentSparseSets[i]->at(from);	// Transfer new component location into place
+		const size_t noOfComponents = componentSparseSets[i]->size();
+
+#endif
+
+		auto* pool = componentPools[i];
+		auto* forkPool = fork->componentPools[i] = new ecs::ComponentPool(pool->elementSize, pool->alignment);
+
+		// A runtime component with a destroy callback owns what it points to, so sharing its bytes would have the parent and the fork both free it
+		if (runtimeDestroyMask.test(i))
+		{
+			memcpy(forkPool->ticks, pool->ticks, noOfComponents * sizeof(Tick));
+			auto copy = runtimeComponents[i].copy;
+			for (size_t j = 0; j < noOfComponents; j++)
+			{
+#if REFAC == 1
+
+				if (!entities[j].compMask.test(i))
+					continue;
+
+#endif
+
+				// Without a copy callback the fork's component is left zeroed
+				assert(copy);
+				if (copy)
+					copy(forkPool->get(j), pool->get(j));
+				else
+					memset(forkPool->get(j), 0, pool->elementSize);
+			}
+			return;
+		}
+
+#ifdef ECS_FORK_COW
+
+		if (pool->share(*forkPool, noOfComponents))
+			return;
+
+#endif
 
-		// The component availability flag is tied only to the dense component array which isn't changed here. 
+		memcpy(forkPool->data, pool->data, noOfComponents * pool->elementSize);
+		memcpy(forkPool->ticks, pool->ticks, noOfComponents * sizeof(Tick));
+	});
+
+	// Singletons
+	fork->singletons = singletons;
+	for (auto& storage : fork->singletons)
+		if (storage.data)
+			storage.data = storage.copy(storage.data);
+
+	// Change detection, disabled and runtime components, buffers, the hierarchy and reactive systems
+	fork->currentTick = currentTick;
+	fork->loadTick = loadTick;
+	fork->systemLastTick = systemLastTick;
+	fork->systemTicks = systemTicks;
+	fork->disabledCounts = disabledCounts;
+	fork->disabledCompMask = disabledCompMask;
+	fork->runtimeComponents = runtimeComponents;
+	fork->runtimeDestroyMask = runtimeDestroyMask;
+	fork->firstRuntimeCompID = firstRuntimeCompID;
+	fork->bufferArena = bufferArena;
+	fork->bufferCompMask = bufferCompMask;
+	fork->bufferElementSizes = bufferElementSizes;
+	fork->hierarchyCompID = hierarchyCompID;
+	fork->bHierarchyIsSorted = bHierarchyIsSorted;
+	fork->observedMask = observedMask;
+	fork->componentEvents = componentEvents;
+
+#if ECS_COMPONENT_ID_CONFIG == 1
+
+	fork->componentIDs = componentIDs;
 
 #endif
 
+	// Indices, each field index is also in the component indices
+	fork->indicesByComp.resize(indicesByComp.size());
+	for (auto* index : componentIndices)
+	{
+		fork->componentIndices.push_back(index->clone());
+		fork->indicesByComp[index->compID].push_back(fork->componentIndices.back());
 	}
-}
+	fork->fieldIndices.resize(fieldIndices.size(), 0);
+	for (size_t i = 0; i < fieldIndices.size(); i++)
+		if (fieldIndices[i])
+			fork->fieldIndices[i] = fork->componentIndices[std::find(componentIndices.begin(), componentIndices.end(), fieldIndices[i]) - componentIndices.begin()];
+	fork->indexedCompMask = indexedCompMask;
 
-// This switches components from a and b
-// This is used for refactoring purposes
-void ECS::switchComponents(EntityID a, EntityID b)
-{
-	if (a == b)
-		return;
+#if REFAC == 2
 
-	// Loop through each possible component this entity could have
-	for (int i = 0; i < MAX_COMPONENTS; i++)
+	fork->componentSparseSets.resize(componentSparseSets.size(), 0);
+	for (size_t i = 0; i < componentSparseSets.size(); i++)
 	{
-		// NOTE, i is the compID which is deliberately fixed as such when the components were created with initComponents<>()
+		auto* sparseSet = componentSparseSets[i];
+		if (!sparseSet)
+			continue;
 
-		// Check component pool exists
-		if (i >= componentPools.size())
-			break;
+		auto* forkSparseSet = fork->componentSparseSets[i] = new ecs::SparseSet();
+		forkSparseSet->dense = sparseSet->dense;
+		forkSparseSet->pages.resize(sparseSet->pages.size(), 0);
+		for (size_t j = 0; j < sparseSet->pages.size(); j++)
+			if (sparseSet->pages[j])
+				forkSparseSet->pages[j] = new ecs::SparsePage(*sparseSet->pages[j]);
+	}
 
-		//// Check entity has this component
-		//if (!entities[from].compMask.test(i))
-		//	continue;
+	for (auto* group : owningGroups)
+		fork->owningGroups.push_back(new ecs::OwningGroup(*group));
+	fork->componentOwningGroups.resize(componentOwningGroups.size(), 0);
+	for (size_t i = 0; i < componentOwningGroups.size(); i++)
+		if (componentOwningGroups[i])
+			fork->componentOwningGroups[i] = fork->owningGroups[std::find(owningGroups.begin(), owningGroups.end(), componentOwningGroups[i]) - owningGroups.begin()];
 
-#if REFAC == 1
+	fork->defragmentCursor = defragmentCursor;
+	fork->defragmentSlots = defragmentSlots;
 
-		// This method requires all component data is copied from one location to another in the components arrays
-		// Directly transfer component data across
-		componentPools[i]->switch_(a, b);
+#endif
 
-#elif REFAC == 2
+#if IMPL == 3
 
-		// This method only requires the changing of an integer in each component sparse set
-		// The entityID has moved so we must tell it in the new sparse set location where it's component is (the old sparse set location's element)
-		// Switching both around allows the old component to be more easily freed for future used - rather than just setting the new sparse set value 
-		const auto old = componentSparseSets[i]->at(a);	// Save old component location
-		componentSparseSets[i]->at(a) = componentSparseSets[i]->at(b);	// Transfer new component location into place
-		componentSparseSets[i]->at(b) = old;		// Give this old entity the old (now redundant) component so it can be freed later
+	for (auto* group : sortingGroups)
+		fork->sortingGroups.push_back(new ecs::SortingGroup(*group));
+	for (auto* group : entityGroups)
+		fork->entityGroups.push_back(new ecs::EntityGroup(*group));
 
-		// The component availability flag is tied only to the dense component array which isn't changed here. 
+	fork->refactorMortonSort = refactorMortonSort;
+	fork->refactorMortonCellSize = refactorMortonCellSize;
 
 #endif
+
+	return fork;
+}
+
+#if REFAC == 2
+
+// Appends a component to the end of its dense array and links the entity to it O(1)
+// The entity's comp mask must already have this component set
+void ECS::addToSparseSet(CompID compID, EntityID entityID)
+{
+	auto* sparseSet = componentSparseSets[compID];
+
+	// The new component goes on the end of the dense array
+	sparseSet->emplace(entityID);
+	sparseSet->index(entityID) = (EntityID)sparseSet->size();
+	sparseSet->dense.push_back(entityID);
+
+	// This component may complete the entity's set of components for an owning group
+	enterOwningGroup(compID, entityID);
+}
+
+// Removes a component from its dense array by moving the last component into its slot O(1)
+void ECS::removeFromSparseSet(CompID compID, EntityID entityID)
+{
+	auto* sparseSet = componentSparseSets[compID];
+
+	// The entity can no longer be in an owning group that needs this component
+	// This moves its component out of the packed section, so the swap-and-pop below never touches the group
+	leaveOwningGroup(compID, entityID);
+
+	// Get the slot being freed and the last slot in the dense array
+	const EntityID index = sparseSet->index(entityID);
+	const EntityID lastIndex = (EntityID)(sparseSet->size() - 1);
+
+	// Move the last component into the freed slot (if it isn't the last one itself)
+	if (index != lastIndex)
+	{
+		const EntityID lastEntity = sparseSet->dense[lastIndex];
+		componentPools[compID]->copy(lastIndex, index);	// Move component data
+		sparseSet->dense[index] = lastEntity;				// Update owner
+		sparseSet->index(lastEntity) = index;				// Point the owner at its new slot
 	}
+
+	// Pop the (now redundant) last slot and free the entity's place in the sparse array
+	sparseSet->dense.pop_back();
+	sparseSet->release(entityID);
 }
 
-void ECS::destroyEntity(EntityID entityID)
+// Switches two components in a dense array, keeping their owners pointing at them
+void ECS::switchDenseComponents(CompID compID, EntityID a, EntityID b)
 {
-	// Return if entity is already dead
-	if (entities[entityID].compMask == 0)
+	if (a == b)
 		return;
 
-	//std::cout << "Destroyed one \n";
+	auto* sparseSet = componentSparseSets[compID];
 
-	auto finalizeDestruction = [&](EntityID index)
-	{
+	// Switch component data
+	componentPools[compID]->switch_(a, b);
 
-#if REFAC == 2
+	// Switch owners and tell them where their components now are
+	std::swap(sparseSet->dense[a], sparseSet->dense[b]);
+	sparseSet->index(sparseSet->dense[a]) = a;
+	sparseSet->index(sparseSet->dense[b]) = b;
+}
 
-		// Free availability of this entity's components
-		// Loop through each possible component this entity could have
-		for (int i = 0; i < MAX_COMPONENTS; i++)
-		{
-			// NOTE, i is the compID which is deliberately fixed as such when the components were created with initComponents<>()
+// Sorts a dense array so its components are in the same order as their owners in the entity array
+void ECS::sortComponentPool(CompID compID)
+{
+	// Owned components are ordered by their group
+	assert(!componentOwningGroups[compID]);
 
-			// Check entity has this component
-			if (!entities[index].compMask.test(i))
-				continue;
+	auto* sparseSet = componentSparseSets[compID];
 
-			// Get component index that this entity uses O(1)
-			auto compIndex = componentSparseSets[i]->at(index);
+	// Get the owners in entity order
+	vector<EntityID> sortedEntities = sparseSet->dense;
+	std::sort(sortedEntities.begin(), sortedEntities.end());
 
-			// Reset component availability bitset O(1)
-			componentAvailabilityBitsets[i]->reset(compIndex);
-		}
+	// Place each entity's component into its sorted slot
+	// Every slot before i is already final, so the component we need is always at or after i
+	for (size_t i = 0; i < sortedEntities.size(); i++)
+		switchDenseComponents(compID, (EntityID)i, sparseSet->index(sortedEntities[i]));
+}
 
-#endif
+// Sorts a dense array so its components are in the same order as the owners of another dense array
+void ECS::sortComponentPoolLike(CompID compID, CompID likeCompID)
+{
+	if (compID == likeCompID)
+		return;
 
-		// Set entity's comp mask to 0 (kills/destroys it)
-		entities[index].compMask = 0;
-	};
+	// Owned components are ordered by their group
+	assert(!componentOwningGroups[compID]);
+
+	auto* sparseSet = componentSparseSets[compID];
 
-	// There is a function called switch entities but this doesn't care about the other entity so this is optimized
-	auto switchDeadEntity = [&](EntityID dead, EntityID alive)
+	// Loop through the other dense array, moving each shared entity's component to the next slot at the front of this dense array
+	EntityID nextIndex = 0;
+	for (auto entityID : componentSparseSets[likeCompID]->dense)
 	{
-		entities[dead].compMask = entities[alive].compMask;
+		// Ignore entities which don't have this component
+		if (!entities[entityID].compMask.test(compID))
+			continue;
 
-		// Transfer component data from old to new entity (this is refactor implementation dependant also)
-#if REFAC == 1
+		switchDenseComponents(compID, nextIndex++, sparseSet->index(entityID));
+	}
+}
 
-		// This doesn't care about what happens to old component, it's automatically handled
-		transferComponents(alive, dead);
+// The dense arrays never have holes since removal is swap-and-pop, but over time that scatters them so that looping through entities in order
+// jumps around each dense array. This moves components back into entity order, like sortComponents, but only examines up to budget entities per call
+// so it can be run a bit each frame. Each call carries on where the last one stopped and it returns true when a full pass has finished.
+// Components owned by a group are skipped since their order is controlled by the group
+bool ECS::defragmentComponents(size_t budget)
+{
+	// Start a new pass
+	if (defragmentCursor == 0)
+		std::fill(defragmentSlots.begin(), defragmentSlots.end(), 0);
 
-#elif REFAC == 2
+	// The entities end at the number of entities, except under implementation 3 after the first refactor where they're in groups which may have
+	// gaps between them. The cursor jumps over a gap to the next group's start
+	size_t end = getNoOfEntities();
 
-		// REFAC 2 needs the components to be switched in order to reset component availability bitsets
-		switchComponents(alive, dead);
+#if IMPL == 3
 
-#endif
+	for (auto* group : entityGroups)
+		end = std::max(end, size_t(group->startIndex) + group->noOfEntities);
+	auto skipGap = [&](size_t id)
+	{
+		size_t next = end;
+		for (auto* group : entityGroups)
+		{
+			if (id >= group->startIndex && id < size_t(group->startIndex) + group->noOfEntities)
+				return id;
+			if (group->noOfEntities && group->startIndex > id)
+				next = std::min(next, size_t(group->startIndex));
+		}
+		return next;
 	};
 
-	// Decrement counter
-	noOfEntities--;
+#endif
 
-	// Implementation 1 does nothing to the components in the component array as they are reset when they are assigned to an entity. 
-#if IMPL == 1
+	for (; budget > 0 && defragmentCursor < end; budget--, defragmentCursor++)
+	{
+#if IMPL == 3
 
-	finalizeDestruction(entityID);
+		if (entities[defragmentCursor].compMask.none() && !entityGroups.empty())
+		{
+			const size_t next = skipGap(defragmentCursor);
+			if (next >= end)
+			{
+				defragmentCursor = (EntityID)end;
+				break;
+			}
+			defragmentCursor = (EntityID)next;
+		}
 
-#elif IMPL == 2
+#endif
 
-	// This implementation must ensure all entities are at the beginning of the array. 
-	// Take the entity at the end of the array and slot it into the new available space
-	switchDeadEntity(entityID, noOfEntities);
+		// Loop through each component this entity has (tags have no dense array)
+		(entities[defragmentCursor].compMask & componentDataMask).forEach([&](CompID i)
+		{
+			// Check component isn't owned
+			if (componentOwningGroups[i])
+				return;
+
+			// Components may have been removed since this pass started, leaving no slots to fill
+			auto* sparseSet = componentSparseSets[i];
+			if (defragmentSlots[i] >= sparseSet->size())
+				return;
+
+			// Move this entity's component into the next slot
+			switchDenseComponents(i, defragmentSlots[i]++, sparseSet->index(defragmentCursor));
+		});
+	}
 
-	// Now kill the old entity
-	finalizeDestruction(noOfEntities);
+	// Return whether this pass has finished
+	if (defragmentCursor < end)
+		return false;
 
-#elif IMPL == 3
+	defragmentCursor = 0;
+	compactBufferArena();
+	return true;
+}
 
-	// This implementation must ensure the entity group remains contiguous
-	// Move the last entity into the slot where the dead entity was and adjust entity group info accordingly
+// Creates an owning group and packs the entities that already have all of its components
+ecs::OwningGroup* ECS::createOwningGroup(CompMask compMask)
+{
+	// Create group
+	auto* group = new ecs::OwningGroup();
+	group->compMask = compMask;
+	owningGroups.push_back(group);
 
-	// Find dead entity's group
-	ecs::EntityGroup* group = 0;
-	for (int i = 0; i < entityGroups.size(); i++)
+	// Give the group ownership of its components
+	compMask.forEach([&](CompID i)
 	{
-		if (entityGroups[i]->compMask == entities[entityID].compMask)
+		// A component's dense array can only be ordered by one group, and tags have no dense array to order
+		assert(!componentOwningGroups[i] && componentDataMask.test(i));
+		componentOwningGroups[i] = group;
+	});
+
+	packOwningGroup(group);
+	return group;
+}
+
+// Moves the entities that have all of a group's components to the front of the dense arrays, making the group's packed section from scratch
+void ECS::packOwningGroup(ecs::OwningGroup* group)
+{
+	bool bFoundFirstComp = false;
+	CompID firstCompID = 0;
+	group->compMask.forEach([&](CompID i)
+	{
+		if (!bFoundFirstComp)
 		{
-			group = entityGroups[i];
-			break;
+			bFoundFirstComp = true;
+			firstCompID = i;
 		}
-	}
-	assert(group);
+	});
 
-	// Up end entity into new place
-	const auto aliveIndex = group->getEndIndex();
-	switchDeadEntity(entityID, aliveIndex);
+	// The owners are copied since entering the group reorders the dense array
+	group->size = 0;
+	const vector<EntityID> owners = componentSparseSets[firstCompID]->dense;
+	for (auto entityID : owners)
+		enterOwningGroup(firstCompID, entityID);
+}
 
-	// Now kill the old entity
-	finalizeDestruction(aliveIndex);	// alive and dead have been switched 
+// If the entity has all of the components of the group owning this component, move it to the end of the group's packed section
+void ECS::enterOwningGroup(CompID compID, EntityID entityID)
+{
+	auto* group = componentOwningGroups[compID];
 
-	// Update group size
-	group->noOfEntities--;
+	// Return if this component isn't owned or the entity doesn't have every component of the group
+	if (!group || !entityHasComponents(entityID, group->compMask))
+		return;
 
-#endif
+	// Return if the entity is already in the group (its components are in the packed section)
+	if (componentSparseSets[compID]->index(entityID) < group->size)
+		return;
+
+	// Switch each of the entity's owned components with the first component after the packed section
+	group->compMask.forEach([&](CompID i)
+	{
+		switchDenseComponents(i, componentSparseSets[i]->index(entityID), (EntityID)group->size);
+	});
+
+	group->size++;
+}
+
+// If the entity is in the group owning this component, move it out of the group's packed section
+void ECS::leaveOwningGroup(CompID compID, EntityID entityID)
+{
+	auto* group = componentOwningGroups[compID];
+
+	// Return if this component isn't owned or the entity isn't in the group
+	if (!group || componentSparseSets[compID]->index(entityID) >= group->size)
+		return;
+
+	// Switch each of the entity's owned components with the last component of the packed section, then shrink it
+	group->size--;
+	group->compMask.forEach([&](CompID i)
+	{
+		switchDenseComponents(i, componentSparseSets[i]->index(entityID), (EntityID)group->size);
+	});
 }
 
+#endif
+
 #if IMPL == 3
 
 void ECS::performFullRefactor()
@@ -293,7 +2466,7 @@ void ECS::performFullRefactor()
 		// Ignore dead entities
 		// Technically, because we are on implementation 3 (to run this function in the first place) the no of entities returns only alive entities
 		// Therefore we should just assert that they are indeed alive
-		assert(entityCompMask != 0);
+		assert(entityCompMask.any());
 
 		// Find the sorting group this entity belongs to
 		bool bFoundSortingGroup = false;
@@ -355,7 +2528,7 @@ void ECS::performFullRefactor()
 		entityGroups.push_back(entityGroup);							// Add entity group to the vector of groups
 
 		// Now place the entities into the correct places - as defined by the entity group
-		const vector<EntityID>& indices = sortingGroups[i]->indices;
+		vector<EntityID>& indices = sortingGroups[i]->indices;
 		for (int j = 0; j < indices.size(); j++)
 		{
 			// Find sorting group of entity to be moved out the way
@@ -384,8 +2557,18 @@ void ECS::performFullRefactor()
 
 			// Switch entities
 			switchEntities(startingIndex + j, indices[j]);
+
+			// This entity is now in place, so its old index mustn't be found when searching for the entity later moved there
+			indices[j] = startingIndex + j;
 		}
 	}
+
+	// Lay the new groups out spatially
+	if (refactorMortonSort)
+		refactorMortonSort(*this, refactorMortonCellSize);
+
+	// Reclaim the buffer arena's unused space while everything is being reorganized anyway
+	compactBufferArena();
 }
 
 #endif
@@ -25,6 +25,16 @@
 		1 - 256 entities (one byte)
 		2 - 65536 entities (two bytes)
 		3 - 4,294,967,296 entities (four bytes)
+
+	The component masks are made of 64 bit words, the number of words sets how many component types this ECS supports:
+		1 - 64 components
+		2 - 128 components
+		3 - 192 components
+		4 - 256 components
+
+	Component IDs (the index of a component's pool) can be set in two ways:
+		1 - at runtime, in the order the components are given to initComponents<>() on each ECS (every ECS has its own comp IDs)
+		2 - at compile time, from the list of component types declared with ECS_COMPONENTS(...) after the components are defined
 */
 // The implementation
 #define IMPL 1
@@ -32,9 +42,15 @@
 #define REFAC 1
 // The number of entities 
 #define ECS_ENTITY_CONFIG 2
+// The number of words in a component mask
+#define ECS_COMPONENT_WORDS 1
+// How component IDs are set
+#define ECS_COMPONENT_ID_CONFIG 1
+// The largest decoded snapshot ECS::loadCompressedSnapshot accepts, so a corrupt size can't allocate without bound
+#define ECS_MAX_SNAPSHOT_BYTES (uint64_t(1) << 32)
 
 // Ensure macros have valid integral numbers
-#if IMPL <= 0 || IMPL > 3 || REFAC <= 0 || REFAC > 2 || ECS_ENTITY_CONFIG <= 0 || ECS_ENTITY_CONFIG > 3
+#if IMPL <= 0 || IMPL > 3 || REFAC <= 0 || REFAC > 2 || ECS_ENTITY_CONFIG <= 0 || ECS_ENTITY_CONFIG > 3 || ECS_COMPONENT_WORDS <= 0 || ECS_COMPONENT_WORDS > 4 || ECS_COMPONENT_ID_CONFIG <= 0 || ECS_COMPONENT_ID_CONFIG > 2
 #error Invalid numbers used as macros (ECS.h)
 #elif IMPL == 1 && REFAC == 2
 #error Cannot use implementation 1 with sparse sets since implementation 1 doesnt refactor at all
@@ -42,14 +58,42 @@
 
 #include <iostream>
 #include <array>
-#include <bitset>
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <map>
+#include <new>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
 #include <assert.h>
 
+// SSE2 is used for component mask compares when the target has it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ECS_MASK_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Snapshots can be memory mapped (see ECS::mapSnapshot) where the OS has mmap
+#if defined(__unix__) || defined(__APPLE__)
+#define ECS_SNAPSHOT_MMAP
+#endif
+
+// Forks share their component pools copy on write (see ECS::fork) where there are memfds and /proc/self/pagemap, elsewhere the pools are copied
+#if defined(ECS_SNAPSHOT_MMAP) && defined(__linux__)
+#define ECS_FORK_COW
+#endif
+
 using std::cout;
 using std::endl;
 using std::array;
-using std::bitset;
 using std::vector;
 using std::unique_ptr;
 
@@ -65,14 +109,135 @@ typedef uint32_t EntityID;
 #endif
 
 // The max number of component types this ECS supports
-#define MAX_COMPONENTS 8
-typedef uint8_t CompID;		// Works for 8 components
-typedef bitset<MAX_COMPONENTS> CompMask;	// Used to efficiently indicate component ownership of entities
+#define MAX_COMPONENTS (ECS_COMPONENT_WORDS * 64)
+typedef uint8_t CompID;		// Works for up to 256 components
+
+// Used to efficiently indicate component ownership of entities
+// The mask is a fixed number of words so every operation is a short loop without branches that the compiler can unroll,
+// and whole mask compares are done 128 bits at a time with SSE2 when it's available
+struct CompMask
+{
+	CompMask() = default;
+
+	constexpr bool test(size_t i) const { return (words[i / 64] >> (i % 64)) & 1; }
+	constexpr void set(size_t i, bool value = true) { words[i / 64] = (words[i / 64] & ~(uint64_t(1) << (i % 64))) | (uint64_t(value) << (i % 64)); }
+	inline void reset() { for (auto& word : words) word = 0; }
+
+	// Returns true if no component bits are set
+	inline bool none() const
+	{
+		uint64_t bits = 0;
+		for (auto word : words)
+			bits |= word;
+		return bits == 0;
+	}
+	inline bool any() const { return !none(); }
+
+	// Returns true if every bit set in other is also set in this mask
+	inline bool contains(const CompMask& other) const
+	{
+		// Accumulate the bits of other that are missing from this mask, then check them once
+		uint64_t missing = 0;
+		size_t i = 0;
+#ifdef ECS_MASK_SSE2
+		__m128i missingVector = _mm_setzero_si128();
+		for (; i + 2 <= ECS_COMPONENT_WORDS; i += 2)
+			missingVector = _mm_or_si128(missingVector, _mm_andnot_si128(load(words + i), load(other.words + i)));
+		missing = isZero(missingVector) ? 0 : 1;
+#endif
+		for (; i < ECS_COMPONENT_WORDS; i++)
+			missing |= other.words[i] & ~words[i];
+		return missing == 0;
+	}
+
+	inline bool operator== (const CompMask& other) const
+	{
+		// Accumulate the bits that differ, then check them once
+		uint64_t difference = 0;
+		size_t i = 0;
+#ifdef ECS_MASK_SSE2
+		__m128i differenceVector = _mm_setzero_si128();
+		for (; i + 2 <= ECS_COMPONENT_WORDS; i += 2)
+			differenceVector = _mm_or_si128(differenceVector, _mm_xor_si128(load(words + i), load(other.words + i)));
+		difference = isZero(differenceVector) ? 0 : 1;
+#endif
+		for (; i < ECS_COMPONENT_WORDS; i++)
+			difference |= words[i] ^ other.words[i];
+		return difference == 0;
+	}
+	inline bool operator!= (const CompMask& other) const { return !(*this == other); }
+
+	inline CompMask operator& (const CompMask& other) const
+	{
+		CompMask output;
+		for (size_t i = 0; i < ECS_COMPONENT_WORDS; i++)
+			output.words[i] = words[i] & other.words[i];
+		return output;
+	}
+	inline CompMask operator| (const CompMask& other) const
+	{
+		CompMask output;
+		for (size_t i = 0; i < ECS_COMPONENT_WORDS; i++)
+			output.words[i] = words[i] | other.words[i];
+		return output;
+	}
+	inline CompMask operator~ () const
+	{
+		CompMask output;
+		for (size_t i = 0; i < ECS_COMPONENT_WORDS; i++)
+			output.words[i] = ~words[i];
+		return output;
+	}
+
+	// Calls func with the comp ID of each set bit, in increasing order
+	// Only set bits are visited, so this is much cheaper than testing every one of MAX_COMPONENTS
+	template<class F> inline void forEach(F func) const
+	{
+		for (size_t i = 0; i < ECS_COMPONENT_WORDS; i++)
+			for (uint64_t bits = words[i]; bits != 0; bits &= bits - 1)	// Clear the lowest set bit each iteration
+				func(CompID(i * 64 + countTrailingZeros(bits)));
+	}
+
+	uint64_t words[ECS_COMPONENT_WORDS] = {};
+
+private:
+	static inline size_t countTrailingZeros(uint64_t bits)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanForward64(&index, bits);
+		return index;
+#elif defined(_MSC_VER)
+		// 32 bit MSVC doesn't have the 64 bit intrinsic, so scan each half
+		unsigned long index;
+		if (_BitScanForward(&index, (unsigned long)bits))
+			return index;
+		_BitScanForward(&index, (unsigned long)(bits >> 32));
+		return index + 32;
+#else
+		return __builtin_ctzll(bits);
+#endif
+	}
+
+#ifdef ECS_MASK_SSE2
+	static inline __m128i load(const uint64_t* words) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(words)); }
+	static inline bool isZero(__m128i vector) { return _mm_movemask_epi8(_mm_cmpeq_epi8(vector, _mm_setzero_si128())) == 0xFFFF; }
+#endif
+};
 
 typedef uint8_t byte;		// Used for dynamic allocation of component pools
+typedef uint32_t Tick;		// Used for change detection, the ECS's tick is advanced by processSystems
+
+#if REFAC == 2
+
+// The sparse sets are split into pages of this many bytes which are only allocated while an entity in their range uses the component
+#define SPARSE_PAGE_SIZE 4096
+#define SPARSE_PAGE_ENTRIES (SPARSE_PAGE_SIZE / sizeof(EntityID))
+
+#endif
 
 // Extern variables
-extern CompID unsetComponentID;
+extern std::atomic<size_t> nextTypeIndex;
 
 //namespace math
 //{
@@ -100,26 +265,790 @@ extern CompID unsetComponentID;
 //	};
 //};
 
+// Declares the component types of the ECS, e.g. ECS_COMPONENTS(c::Position, c::Translation)
+// This is only needed for ECS_COMPONENT_ID_CONFIG 2 but can be used with either so switching configs doesn't need code changes
+#if ECS_COMPONENT_ID_CONFIG == 1
+#define ECS_COMPONENTS(...)
+#elif ECS_COMPONENT_ID_CONFIG == 2
+#define ECS_COMPONENTS(...) namespace ecs { template<class T> struct ComponentList { typedef Components<__VA_ARGS__> type; }; }
+#endif
+
 namespace ecs
 {
+	// A list of component types, the index of a type in the list is its comp ID when using ECS_COMPONENT_ID_CONFIG 2
+	template<class ... T>
+	struct Components
+	{
+		static constexpr size_t count = sizeof...(T);
+
+		// Returns the index of C in this list, or count if C isn't in the list
+		template<class C> static constexpr size_t indexOf()
+		{
+			constexpr bool matches[] = { std::is_same_v<C, T> ..., false };
+			for (size_t i = 0; i < count; i++)
+				if (matches[i])
+					return i;
+			return count;
+		}
+		template<class C> static constexpr bool contains() { return indexOf<C>() < count; }
+	};
+
+	// Every type used with an ECS is given a process wide type index the first time it's used. This isn't a comp ID,
+	// each ECS maps the type indices to its own comp IDs so different ECSs can create their components in different orders
+	// The counter is atomic so ECSs on different threads can safely create their components at the same time
+	// Each type's index is kept plus one in a constant initialised atomic (0 until the type is first used), rather than a function-local static,
+	// so reading it (as getCompID<T>() does for every access) has no initialisation guard and it's still assigned on first use during static initialisation
+	template<class T> inline std::atomic<size_t> typeIndexPlusOne = 0;
+	template<class T> inline size_t getTypeIndex()
+	{
+		const size_t indexPlusOne = typeIndexPlusOne<T>.load(std::memory_order_relaxed);
+		if (indexPlusOne)
+			return indexPlusOne - 1;
+
+		// If another thread assigns the type first, its index is used and this one is skipped
+		size_t expected = 0;
+		const size_t assigned = nextTypeIndex++ + 1;	// Set to current value and increment for next type
+		return typeIndexPlusOne<T>.compare_exchange_strong(expected, assigned) ? assigned - 1 : expected - 1;
+	}
+
+#if ECS_COMPONENT_ID_CONFIG == 2
+
+	// The list of component types this ECS uses. It's only declared here and defined with ECS_COMPONENTS(...) once the components are defined,
+	// which works because getCompID<T>() only looks at it when it's instantiated for a component. T is unused, it just makes the lookup wait.
+	template<class T> struct ComponentList;
+
+#endif
+
+	// Used in a query's component list to say the system reads a singleton, e.g. getEntitiesWithComponents<c::Position, ecs::Singleton<c::Time>>()
+	// It doesn't add anything to the comp mask, the query just checks the singleton has been set
+	template<class T>
+	struct Singleton
+	{
+		typedef T type;
+	};
+
+	template<class T> struct IsSingleton : std::false_type {};
+	template<class T> struct IsSingleton<Singleton<T>> : std::true_type {};
+
+	// Used in a query's component list to only match entities whose T has been written since the system running the query last ran,
+	// e.g. getEntitiesWithComponents<c::Position, ecs::Changed<c::Translation>>()
+	template<class T>
+	struct Changed
+	{
+		typedef T type;
+	};
+
+	template<class T> struct IsChanged : std::false_type {};
+	template<class T> struct IsChanged<Changed<T>> : std::true_type {};
+
+	// The component a query's list entry needs the entity to have, i.e. T for both T and Changed<T>
+	template<class T> struct QueryComponent { typedef T type; };
+	template<class T> struct QueryComponent<Changed<T>> { typedef T type; };
+
+	// The add and remove events of an observed component, queued until a reactive system drains them
+	struct ComponentEvents
+	{
+		ComponentEvents() = default;
+
+		inline bool empty() { return added.empty() && removed.empty(); }
+
+		// Queues an added event, an entity is only ever in added once
+		inline void add(EntityID entityID)
+		{
+			addedIndices[entityID] = added.size();
+			added.push_back(entityID);
+		}
+
+		// Takes an entity's added event out of the queue (swapping the last event into its place), returning false if it isn't queued
+		inline bool cancelAdd(EntityID entityID)
+		{
+			auto it = addedIndices.find(entityID);
+			if (it == addedIndices.end())
+				return false;
+
+			const size_t index = it->second;
+			addedIndices.erase(it);
+			if (index != added.size() - 1)
+			{
+				added[index] = added.back();
+				addedIndices[added[index]] = index;
+			}
+			added.pop_back();
+			return true;
+		}
+
+		// Keeps an entity's added event pointing at it as it moves
+		inline void move(EntityID from, EntityID to)
+		{
+			auto it = addedIndices.find(from);
+			if (it == addedIndices.end())
+				return;
+
+			const size_t index = it->second;
+			addedIndices.erase(it);
+			added[index] = to;
+			addedIndices[to] = index;
+		}
+		inline void switch_(EntityID a, EntityID b)
+		{
+			auto itA = addedIndices.find(a);
+			auto itB = addedIndices.find(b);
+			const size_t indexA = itA != addedIndices.end() ? itA->second : added.size();
+			const size_t indexB = itB != addedIndices.end() ? itB->second : added.size();
+			if (itA != addedIndices.end())
+				addedIndices.erase(itA);
+			if (itB != addedIndices.end())
+				addedIndices.erase(itB);
+
+			if (indexA != added.size())
+			{
+				added[indexA] = b;
+				addedIndices[b] = indexA;
+			}
+			if (indexB != added.size())
+			{
+				added[indexB] = a;
+				addedIndices[a] = indexB;
+			}
+		}
+
+		inline void clear()
+		{
+			added.clear();
+			removed.clear();
+			addedIndices.clear();
+		}
+
+		vector<EntityID> added;		// Entities that have gained the component and still have it (their IDs are kept up to date as they move)
+		vector<EntityID> removed;	// Entities that have lost the component, an ID may already have been reused by an entity in added
+		std::unordered_map<EntityID, size_t> addedIndices;	// The index of each entity in added, so cancelling and moving an event is O(1)
+	};
+
+	// The built in parent/child relationship, created like any other component with initComponents<ecs::Hierarchy>() and linked with setParent
+	// The links are entity IDs which the ECS keeps pointing at the right entities as they move
+	struct Hierarchy
+	{
+		Hierarchy() = default;
+
+		static constexpr EntityID none = EntityID(-1);	// Used for missing links
+
+		EntityID parent = none;
+		EntityID firstChild = none;
+		EntityID nextSibling = none;
+		uint32_t depth = 0;			// The number of ancestors, i.e. 0 for roots
+	};
+
+	// The part of a buffer component that doesn't depend on its element type, used by the ECS to find overflow blocks when compacting the arena
+	struct BufferHeader
+	{
+		BufferHeader() = default;
+
+		uint32_t size = 0;				// The number of elements
+		uint32_t overflowCapacity = 0;	// The number of elements the overflow block holds, 0 while the elements are inline
+		size_t overflowOffset = 0;		// The byte offset of the overflow block in the ECS's buffer arena
+	};
+
+	// A variable length component, e.g. struct Inventory : ecs::Buffer<Item, 8> {};
+	// Up to N elements are stored inline in the component pool. Past that they are all moved into one block of the ECS's buffer arena
+	// so they stay contiguous. Elements must be trivially copyable since they are moved with memcpy. Access them with ECS::getBuffer<>()
+	// A buffer component shouldn't be copied onto another entity's buffer, the copy would share the original's overflow block
+	template<class T, size_t N>
+	struct Buffer : BufferHeader
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "Buffer elements are moved with memcpy");
+		static_assert(alignof(T) <= alignof(std::max_align_t), "Buffer elements can't be aligned more than the arena's blocks");
+		static_assert(N > 0, "Buffers need at least one inline element, a capacity of 0 would let push_back write past the component");
+
+		typedef T element;
+		static constexpr size_t inlineCapacity = N;
+
+		T inlineElements[N];
+	};
+
+	// The world owned storage of buffers that have outgrown their inline elements
+	// Blocks are only ever appended, blocks that are no longer used are reclaimed when the ECS compacts the arena
+	struct BufferArena
+	{
+		BufferArena() = default;
+
+		static constexpr size_t blockAlignment = alignof(std::max_align_t);
+
+		// Appends a block and returns its offset (not a pointer since the arena moves when it grows)
+		inline size_t allocate(size_t bytes)
+		{
+			const size_t offset = (data.size() + blockAlignment - 1) & ~(blockAlignment - 1);
+			data.resize(offset + bytes);
+			return offset;
+		}
+
+		vector<byte> data;
+	};
+
+	// Gives access to the elements of a buffer component, only valid until the component or arena is moved (i.e. like a component pointer)
+	template<class B>
+	struct BufferRef
+	{
+		typedef typename B::element T;
+
+		BufferRef(B* buffer_, BufferArena* arena_) : buffer{ buffer_ }, arena{ arena_ } {}
+
+		inline T* data() { return buffer->overflowCapacity ? reinterpret_cast<T*>(arena->data.data() + buffer->overflowOffset) : buffer->inlineElements; }
+		inline size_t size() { return buffer->size; }
+		inline size_t capacity() { return buffer->overflowCapacity ? buffer->overflowCapacity : B::inlineCapacity; }
+		inline bool empty() { return buffer->size == 0; }
+
+		inline T& operator[](size_t i) { return data()[i]; }
+		inline T* begin() { return data(); }
+		inline T* end() { return data() + buffer->size; }
+
+		inline void push_back(const T& value)
+		{
+			if (buffer->size == capacity())
+				reserve(capacity() * 2);
+			data()[buffer->size++] = value;
+		}
+		inline void pop_back() { buffer->size--; }
+		inline void clear() { buffer->size = 0; }
+
+		// Moves the elements into a bigger overflow block, the old block is left for the arena's compaction to reclaim
+		void reserve(size_t newCapacity)
+		{
+			if (newCapacity <= capacity())
+				return;
+
+			// Allocate first since the arena may move
+			const size_t offset = arena->allocate(newCapacity * sizeof(T));
+			memcpy(arena->data.data() + offset, data(), buffer->size * sizeof(T));
+			buffer->overflowOffset = offset;
+			buffer->overflowCapacity = (uint32_t)newCapacity;
+		}
+
+		B* buffer;
+		BufferArena* arena;
+	};
+
+	// Splits a pointer to a component's field into the component and field types
+	template<class M> struct FieldPointer;
+	template<class T, class V> struct FieldPointer<V T::*>
+	{
+		typedef T component;
+		typedef V value;
+	};
+
+	// An index from the values of one component field to the entities whose component holds that value, see ECS::createIndex
+	// The ECS tells the index when components are added, removed or moved. Writes can't be seen as they happen, so components handed out
+	// through a mutable accessor are marked dirty and re-read the next time the index is searched. Newly assigned components are dirty too,
+	// so their value is only read once the caller has had the chance to set it
+	struct ComponentIndex
+	{
+		ComponentIndex(CompID compID_, bool bUnique_) : compID{ compID_ }, bUnique{ bUnique_ } {}
+		virtual ~ComponentIndex() = default;
+
+		virtual void add(EntityID entityID, const void* comp) = 0;		// Reads the entity's value now
+		virtual void addLater(EntityID entityID) = 0;					// Reads the entity's value the next time the index is searched
+		virtual void remove(EntityID entityID) = 0;
+		virtual void move(EntityID from, EntityID to) = 0;				// Moving doesn't change the value, so an entity only needs to be re-read if it was dirty
+		virtual void switch_(EntityID a, EntityID b) = 0;
+		virtual void markDirty(EntityID entityID) = 0;
+		virtual ComponentIndex* clone() const = 0;						// A copy of the index for a fork of the ECS
+
+		const CompID compID;
+		const bool bUnique;				// Whether each value can only be used by one entity
+		vector<EntityID> dirtyEntities;	// Entities whose value may have been written since it was last read (IDs may be stale, they are checked)
+	};
+
+	// An index of a field's values kept in a multimap style container (Values), which decides whether the index is hashed or ordered
+	template<auto Field, class Values>
+	struct FieldIndexBase : ComponentIndex
+	{
+		typedef typename FieldPointer<decltype(Field)>::component Component;
+		typedef typename FieldPointer<decltype(Field)>::value Value;
+
+		// An entity's indexed value, kept so its element in the index can be found after the field has been overwritten
+		struct Entry
+		{
+			Value value = Value();
+			bool bDirty = false;
+			bool bIndexed = false;	// Whether the value is in the index yet
+		};
+
+		FieldIndexBase(CompID compID_, bool bUnique_) : ComponentIndex(compID_, bUnique_) {}
+
+		void add(EntityID entityID, const void* comp) override
+		{
+			const Value& value = static_cast<const Component*>(comp)->*Field;
+
+			auto& entry = entries[entityID];
+			entry.bDirty = false;
+			if (entry.bIndexed)
+			{
+				if (entry.value == value)
+					return;
+
+				// The value has changed, so remove the old one
+				values.erase(findValue(entry.value, entityID));
+			}
+
+			assert(!bUnique || values.find(value) == values.end());	// Another entity already has this value
+			entry.value = value;
+			entry.bIndexed = true;
+			values.emplace(value, entityID);
+		}
+
+		void addLater(EntityID entityID) override
+		{
+			entries.emplace(entityID, Entry());
+			markDirty(entityID);
+		}
+
+		void remove(EntityID entityID) override
+		{
+			auto it = entries.find(entityID);
+			if (it == entries.end())
+				return;
+
+			if (it->second.bIndexed)
+				values.erase(findValue(it->second.value, entityID));
+			entries.erase(it);
+		}
+
+		void move(EntityID from, EntityID to) override
+		{
+			auto it = entries.find(from);
+			if (it == entries.end())
+				return;
+
+			if (it->second.bIndexed)
+				findValue(it->second.value, from)->second = to;
+			const Entry entry = it->second;
+			entries.erase(it);
+			entries[to] = entry;
+
+			// A dirty entity must be re-read at its new ID
+			if (entry.bDirty)
+				dirtyEntities.push_back(to);
+		}
+
+		void switch_(EntityID a, EntityID b) override
+		{
+			auto itA = entries.find(a);
+			auto itB = entries.find(b);
+
+			if (itA == entries.end() || itB == entries.end())
+			{
+				// Only one of them is in the index, so it's just a move
+				if (itA != entries.end())
+					move(a, b);
+				else if (itB != entries.end())
+					move(b, a);
+				return;
+			}
+
+			// Find both values before renaming either, so the second search doesn't find the first
+			auto valueA = itA->second.bIndexed ? findValue(itA->second.value, a) : values.end();
+			auto valueB = itB->second.bIndexed ? findValue(itB->second.value, b) : values.end();
+			if (valueA != values.end())
+				valueA->second = b;
+			if (valueB != values.end())
+				valueB->second = a;
+			std::swap(itA->second, itB->second);
+
+			if (itA->second.bDirty)
+				dirtyEntities.push_back(a);
+			if (itB->second.bDirty)
+				dirtyEntities.push_back(b);
+		}
+
+		void markDirty(EntityID entityID) override
+		{
+			auto it = entries.find(entityID);
+			if (it != entries.end() && !it->second.bDirty)
+			{
+				it->second.bDirty = true;
+				dirtyEntities.push_back(entityID);
+			}
+		}
+
+		Values values;									// The index, value to entity
+		std::unordered_map<EntityID, Entry> entries;	// Entity to value
+
+	private:
+		// Returns an entity's element in the index, the entity must be indexed under this value
+		inline typename Values::iterator findValue(const Value& value, EntityID entityID)
+		{
+			auto range = values.equal_range(value);
+			for (auto it = range.first; it != range.second; it++)
+				if (it->second == entityID)
+					return it;
+
+			assert(false);
+			return values.end();
+		}
+	};
+
+	// A hash index, for O(1) lookups of the entities with a value
+	template<auto Field>
+	struct FieldIndex : FieldIndexBase<Field, std::unordered_multimap<typename FieldPointer<decltype(Field)>::value, EntityID>>
+	{
+		using FieldIndexBase<Field, std::unordered_multimap<typename FieldPointer<decltype(Field)>::value, EntityID>>::FieldIndexBase;
+
+		ComponentIndex* clone() const override { return new FieldIndex(*this); }
+	};
+
+	// An ordered index, for finding the entities with values in a range in order of their values (O(log n) to find the start of the range)
+	template<auto Field>
+	struct RangeIndex : FieldIndexBase<Field, std::multimap<typename FieldPointer<decltype(Field)>::value, EntityID>>
+	{
+		using FieldIndexBase<Field, std::multimap<typename FieldPointer<decltype(Field)>::value, EntityID>>::FieldIndexBase;
+
+		ComponentIndex* clone() const override { return new RangeIndex(*this); }
+	};
+
+	// A uniform grid over a 2D position field (any type with x and y members), for finding the entities near a point, see ECS::createGridIndex
+	// Each entity is kept in the cell its position falls in. Cells are stored sparsely, so the world has no bounds and empty space costs nothing
+	template<auto Field>
+	struct GridIndex : ComponentIndex
+	{
+		typedef typename FieldPointer<decltype(Field)>::component Component;
+		typedef typename FieldPointer<decltype(Field)>::value Value;
+
+		// An entity in a cell, with its position so queries don't have to visit the component pool
+		struct Element
+		{
+			EntityID entityID;
+			Value position;
+		};
+
+		// The cell an entity is in
+		struct Entry
+		{
+			uint64_t cell = 0;
+			bool bDirty = false;
+			bool bIndexed = false;	// Whether the entity is in a cell yet
+		};
+
+		GridIndex(CompID compID_, float cellSize_) : ComponentIndex(compID_, false), cellSize{ cellSize_ } { assert(cellSize > 0.f); }
+
+		ComponentIndex* clone() const override { return new GridIndex(*this); }
+
+		void add(EntityID entityID, const void* comp) override
+		{
+			const Value& position = static_cast<const Component*>(comp)->*Field;
+			const uint64_t cell = getCellKey(getCell((float)position.x), getCell((float)position.y));
+
+			auto& entry = entries[entityID];
+			entry.bDirty = false;
+			if (entry.bIndexed)
+			{
+				// Most writes don't leave the cell
+				if (entry.cell == cell)
+				{
+					findElement(cell, entityID)->position = position;
+					return;
+				}
+
+				eraseElement(entry.cell, entityID);
+			}
+
+			entry.cell = cell;
+			entry.bIndexed = true;
+			cells[cell].push_back({ entityID, position });
+		}
+
+		void addLater(EntityID entityID) override
+		{
+			entries.emplace(entityID, Entry());
+			markDirty(entityID);
+		}
+
+		void remove(EntityID entityID) override
+		{
+			auto it = entries.find(entityID);
+			if (it == entries.end())
+				return;
+
+			if (it->second.bIndexed)
+				eraseElement(it->second.cell, entityID);
+			entries.erase(it);
+		}
+
+		void move(EntityID from, EntityID to) override
+		{
+			auto it = entries.find(from);
+			if (it == entries.end())
+				return;
+
+			if (it->second.bIndexed)
+				findElement(it->second.cell, from)->entityID = to;
+			const Entry entry = it->second;
+			entries.erase(it);
+			entries[to] = entry;
+
+			// A dirty entity must be re-read at its new ID
+			if (entry.bDirty)
+				dirtyEntities.push_back(to);
+		}
+
+		void switch_(EntityID a, EntityID b) override
+		{
+			auto itA = entries.find(a);
+			auto itB = entries.find(b);
+
+			if (itA == entries.end() || itB == entries.end())
+			{
+				// Only one of them is in the index, so it's just a move
+				if (itA != entries.end())
+					move(a, b);
+				else if (itB != entries.end())
+					move(b, a);
+				return;
+			}
+
+			// Find both elements before renaming either, so the second search doesn't find the first
+			Element* elementA = itA->second.bIndexed ? findElement(itA->second.cell, a) : 0;
+			Element* elementB = itB->second.bIndexed ? findElement(itB->second.cell, b) : 0;
+			if (elementA)
+				elementA->entityID = b;
+			if (elementB)
+				elementB->entityID = a;
+			std::swap(itA->second, itB->second);
+
+			if (itA->second.bDirty)
+				dirtyEntities.push_back(a);
+			if (itB->second.bDirty)
+				dirtyEntities.push_back(b);
+		}
+
+		void markDirty(EntityID entityID) override
+		{
+			auto it = entries.find(entityID);
+			if (it != entries.end() && !it->second.bDirty)
+			{
+				it->second.bDirty = true;
+				dirtyEntities.push_back(entityID);
+			}
+		}
+
+		// Calls f(element) for every entity in the cells overlapping the box, which may include entities just outside of it
+		template<class F>
+		void forEachInCells(float minX, float minY, float maxX, float maxY, F f)
+		{
+			const int32_t minCellX = getCell(minX), minCellY = getCell(minY);
+			const int32_t maxCellX = getCell(maxX), maxCellY = getCell(maxY);
+
+			const uint64_t noOfCells = uint64_t(int64_t(maxCellX) - minCellX + 1) * uint64_t(int64_t(maxCellY) - minCellY + 1);
+			if (noOfCells > cells.size())
+			{
+				// The box covers more cells than are in use, so visit the used ones instead
+				for (auto& [key, elements] : cells)
+				{
+					const int32_t x = int32_t(uint32_t(key >> 32)), y = int32_t(uint32_t(key));
+					if (x >= minCellX && x <= maxCellX && y >= minCellY && y <= maxCellY)
+						for (auto& element : elements)
+							f(element);
+				}
+				return;
+			}
+
+			for (int64_t x = minCellX; x <= maxCellX; x++)
+				for (int64_t y = minCellY; y <= maxCellY; y++)
+				{
+					auto it = cells.find(getCellKey((int32_t)x, (int32_t)y));
+					if (it != cells.end())
+						for (auto& element : it->second)
+							f(element);
+				}
+		}
+
+		const float cellSize;
+		std::unordered_map<uint64_t, vector<Element>> cells;	// The entities in each cell, keyed by the cell's coordinates
+		std::unordered_map<EntityID, Entry> entries;			// Entity to cell
+
+	private:
+		inline int32_t getCell(float coordinate) const { return (int32_t)std::floor(coordinate / cellSize); }
+		static inline uint64_t getCellKey(int32_t x, int32_t y) { return (uint64_t(uint32_t(x)) << 32) | uint32_t(y); }
+
+		// Returns an entity's element, the entity must be in this cell
+		inline Element* findElement(uint64_t cell, EntityID entityID)
+		{
+			for (auto& element : cells[cell])
+				if (element.entityID == entityID)
+					return &element;
+
+			assert(false);
+			return 0;
+		}
+
+		inline void eraseElement(uint64_t cell, EntityID entityID)
+		{
+			auto it = cells.find(cell);
+			auto& elements = it->second;
+			*findElement(cell, entityID) = elements.back();
+			elements.pop_back();
+
+			if (elements.empty())
+				cells.erase(it);
+		}
+	};
+
+	// Interleaves the bits of a 2D cell's coordinates, so sorting by the code walks the cells along a Z shaped curve that keeps nearby cells close together
+	inline uint64_t getMortonCode(int32_t x, int32_t y)
+	{
+		// Spreads the 32 bits out to every other bit of 64
+		auto spread = [](uint64_t v)
+		{
+			v = (v | v << 16) & 0x0000ffff0000ffffull;
+			v = (v | v << 8) & 0x00ff00ff00ff00ffull;
+			v = (v | v << 4) & 0x0f0f0f0f0f0f0f0full;
+			v = (v | v << 2) & 0x3333333333333333ull;
+			v = (v | v << 1) & 0x5555555555555555ull;
+			return v;
+		};
+
+		// Flip the sign bits so negative coordinates come before positive ones
+		return spread(uint32_t(x) ^ 0x80000000u) | spread(uint32_t(y) ^ 0x80000000u) << 1;
+	}
+
+	// The start of a snapshot written by ECS::saveSnapshot (diffs and compressed snapshots have their own magic)
+	// A snapshot can only be loaded by an ECS with the same configuration and components
+	struct SnapshotHeader
+	{
+		SnapshotHeader() = default;
+
+		inline bool matches(const SnapshotHeader& other) const
+		{
+			return memcmp(magic, other.magic, sizeof(magic)) == 0 && version == other.version && impl == other.impl && refac == other.refac &&
+				entityConfig == other.entityConfig && componentWords == other.componentWords && noOfComponents == other.noOfComponents;
+		}
+
+		char magic[4] = { 'E', 'C', 'S', 'S' };
+		uint32_t version = 2;
+		uint32_t impl = IMPL;
+		uint32_t refac = REFAC;
+		uint32_t entityConfig = ECS_ENTITY_CONFIG;
+		uint32_t componentWords = ECS_COMPONENT_WORDS;
+		uint32_t noOfComponents = 0;
+		uint32_t blockAlignment = 1;	// The file offset of each pool's data and ticks is a multiple of this, see ECS::saveSnapshot
+	};
+
+	// Receives a snapshot as it's written, as a series of blocks. stride is the size of the block's elements (1 for loose values)
+	struct SnapshotSink
+	{
+		virtual ~SnapshotSink() = default;
+
+		virtual void write(const void* data, size_t bytes, size_t stride) = 0;
+	};
+
+	// The last frame written or read by ECS::saveCompressedSnapshot or ECS::loadCompressedSnapshot, the next frame is encoded against it
+	// The writer and the reader each keep their own
+	struct SnapshotHistory
+	{
+		SnapshotHistory() = default;
+
+		vector<byte> frame;				// The last frame as an uncompressed snapshot
+		vector<size_t> blockStarts;		// Where each of its blocks starts in frame, followed by the end of the last block
+	};
+
+	// A singleton's storage, one per ECS rather than a pool per component
+	struct SingletonStorage
+	{
+		SingletonStorage() = default;
+
+		void* data = 0;					// The singleton (null if it hasn't been set)
+		void (*destroy)(void*) = 0;		// Deletes data as its real type
+		void* (*copy)(const void*) = 0;	// Copies data as its real type, for a fork of the ECS
+	};
+
 	struct EntityDesignation
 	{
 		EntityDesignation() = default;
 
-		CompMask compMask = 0;
+		CompMask compMask;
+		CompMask disabledMask;	// The components this entity has that are disabled (always a subset of compMask)
 	};
 
+#ifdef ECS_SNAPSHOT_MMAP
+
+	// Unmaps memory mapped by ECS::mapSnapshot, defined in the cpp so the header doesn't need the OS headers
+	void unmapMemory(void* data, size_t bytes);
+
+#endif
+
+#ifdef ECS_FORK_COW
+
+	// Maps zeroed memory, so a component pool can later be remapped copy on write in place (throws std::bad_alloc if it fails)
+	void* mapMemory(size_t bytes);
+	void closeFile(int file);
+
+#endif
+
 	struct ComponentPool
 	{
-		ComponentPool(size_t elementSize_) :
-			elementSize{ elementSize_ }	// Set element size
+		ComponentPool(size_t elementSize_, size_t alignment_ = alignof(std::max_align_t)) :
+			elementSize{ elementSize_ },	// Set element size
+			alignment{ alignment_ }
 		{
-			// Dynamically create component pool
-			data = new byte[elementSize * MAX_ENTITIES];
+#ifdef ECS_FORK_COW
+
+			// The storage is mapped rather than allocated so forks can share it copy on write without moving it (mappings are page aligned)
+			mappedDataBytes = elementSize * MAX_ENTITIES;
+			mappedTickBytes = sizeof(Tick) * MAX_ENTITIES;
+			data = static_cast<byte*>(mapMemory(mappedDataBytes));
+			ticks = static_cast<Tick*>(mapMemory(mappedTickBytes));
+
+#else
+
+			// Dynamically create component pool, aligned for the component (the element size is a multiple of the alignment so every element is aligned)
+			data = static_cast<byte*>(::operator new[](elementSize * MAX_ENTITIES, std::align_val_t(alignment)));
+			ticks = new Tick[MAX_ENTITIES]();	// Zero initialized, i.e. never written
+
+#endif
 		}
 		~ComponentPool()
 		{
-			delete[] data;
+			freeStorage();
+		}
+
+#ifdef ECS_SNAPSHOT_MMAP
+
+		// Replaces the pool's storage with regions mapped from a snapshot, which the pool then owns
+		void adoptMapping(byte* data_, size_t dataBytes, Tick* ticks_, size_t tickBytes)
+		{
+			freeStorage();
+			data = data_;
+			ticks = ticks_;
+			mappedDataBytes = dataBytes;
+			mappedTickBytes = tickBytes;
+		}
+
+#endif
+
+#ifdef ECS_FORK_COW
+
+		// Shares the first noOfComponents components (and their ticks) with a fork's pool copy on write, see ECS::fork. Returns false if it fails
+		bool share(ComponentPool& fork, size_t noOfComponents);
+
+#endif
+
+		inline void freeStorage()
+		{
+#ifdef ECS_FORK_COW
+			if (dataFile != -1)
+				closeFile(dataFile);
+			if (tickFile != -1)
+				closeFile(tickFile);
+			dataFile = tickFile = -1;
+#endif
+#ifdef ECS_SNAPSHOT_MMAP
+			if (mappedDataBytes)
+			{
+				unmapMemory(data, mappedDataBytes);
+				unmapMemory(ticks, mappedTickBytes);
+				return;
+			}
+#endif
+			::operator delete[](data, std::align_val_t(alignment));
+			delete[] ticks;
 		}
 
 		inline void* get(size_t index)
@@ -127,26 +1056,124 @@ namespace ecs
 			return data + index * elementSize;
 		}
 
+		// The tick of a component moves with its data
 		inline void copy(size_t from, size_t to)
 		{
 			memcpy(data + to * elementSize, data + from * elementSize, elementSize);
+			ticks[to] = ticks[from];
 		}
 
 		inline void switch_ (size_t a, size_t b)
 		{
-			byte *b_data = new byte[elementSize];	// Get place to store b's new data
-			memcpy(b_data, get(a), elementSize);	// Store b's new data
-			copy(a, b);								// Copy data from a to b
-			memcpy(get(b), b_data, elementSize);	// Copy data from storage into b
-
-			// Free memory
-			delete[] b_data;
+			// Swap the bytes of a and b in place, this doesn't need any temporary storage
+			std::swap_ranges(data + a * elementSize, data + (a + 1) * elementSize, data + b * elementSize);
+			std::swap(ticks[a], ticks[b]);
 		}
 
 		byte* data = 0;
+		Tick* ticks = 0;	// The tick each component was last written on (through a mutable accessor)
 		const size_t elementSize;
+		const size_t alignment;
+
+#ifdef ECS_SNAPSHOT_MMAP
+		// The size of the mappings holding the data and ticks (0 if they were allocated)
+		size_t mappedDataBytes = 0;
+		size_t mappedTickBytes = 0;
+#endif
+#ifdef ECS_FORK_COW
+		// The memfds the data and ticks are private mappings of once they've been shared with a fork (-1 if they aren't)
+		int dataFile = -1;
+		int tickFile = -1;
+#endif
 	};
 
+	// The description of a component registered at runtime with ECS::registerComponent
+	struct RuntimeComponent
+	{
+		RuntimeComponent() = default;
+
+		std::string name;
+		size_t size = 0;
+		void (*construct)(void*) = 0;	// Initializes a newly assigned component (null to zero it)
+		void (*destroy)(void*) = 0;		// Cleans up a component being removed (null if there's nothing to clean up)
+		void (*copy)(void*, const void*) = 0;	// Copies a component into uninitialized memory, for a fork of the ECS (null if it can't be)
+	};
+
+#if REFAC == 2
+
+	// One page of a sparse set, covering SPARSE_PAGE_ENTRIES consecutive entity IDs
+	struct SparsePage
+	{
+		SparsePage() = default;
+
+		array<EntityID, SPARSE_PAGE_ENTRIES> indices;	// The dense index of each entity in this page's range
+		size_t noOfEntries = 0;							// The number of entities in this page's range that are in the set
+	};
+
+	// A packed sparse set linking entity IDs to indices in a component's dense pool
+	// Removal swaps the last element into the freed slot (swap-and-pop) so the dense arrays never have holes,
+	// i.e. the live components of a pool are always in [0, size())
+	// The sparse array is paged so a component only used by a few entities only costs a few pages rather than MAX_ENTITIES indices
+	struct SparseSet
+	{
+		SparseSet() = default;
+		~SparseSet()
+		{
+			for (auto* page : pages)
+				delete page;
+			pages.clear();
+		}
+
+		// Returns the dense index of an entity, the entity must have been emplaced
+		inline EntityID& index(EntityID entityID) { return pages[entityID / SPARSE_PAGE_ENTRIES]->indices[entityID % SPARSE_PAGE_ENTRIES]; }
+		inline size_t size() { return dense.size(); }
+
+		// Reserves an entity's slot in the sparse array, allocating its page on first use
+		inline void emplace(EntityID entityID)
+		{
+			const size_t pageIndex = entityID / SPARSE_PAGE_ENTRIES;
+
+			// Grow the page table if this entity is past the end
+			if (pageIndex >= pages.size())
+				pages.resize(pageIndex + 1, 0);
+
+			// Allocate page if it doesn't exist
+			if (!pages[pageIndex])
+				pages[pageIndex] = new SparsePage();
+
+			pages[pageIndex]->noOfEntries++;
+		}
+
+		// Frees an entity's slot in the sparse array, returning its page when no other entity uses it
+		inline void release(EntityID entityID)
+		{
+			const size_t pageIndex = entityID / SPARSE_PAGE_ENTRIES;
+
+			// Free page if this was the last entity using it
+			if (--pages[pageIndex]->noOfEntries == 0)
+			{
+				delete pages[pageIndex];
+				pages[pageIndex] = 0;
+			}
+		}
+
+		vector<SparsePage*> pages;	// The sparse array, a null page means no entity in its range is in the set
+		vector<EntityID> dense;		// The dense index indexes this array, the element is the entity that owns that component
+	};
+
+	// An owning group keeps the entities that have all of its components packed at the front of each of those components' dense arrays,
+	// in the same order. Looping through the group is then just looping through the dense arrays in parallel from 0 to size
+	// This is the sparse set counterpart of the EntityGroups used by implementation 3
+	struct OwningGroup
+	{
+		OwningGroup() = default;
+
+		CompMask compMask;		// The components owned by this group
+		size_t size = 0;			// The number of entities in this group (the length of the packed section of each dense array)
+	};
+
+#endif
+
 #if IMPL == 3
 
 	// The sorting group is used to sort an unordered entity array into known groups (EntityGroups)
@@ -155,7 +1182,7 @@ namespace ecs
 		SortingGroup() = default;
 
 		vector<EntityID> indices;	// All indices of entities in the main entity array that have this comp mask
-		CompMask compMask = 0;		// The components used by this group
+		CompMask compMask;		// The components used by this group
 	};
 
 	// The entity group is what is used to allow for more efficient looping and other benefits. 
@@ -168,7 +1195,7 @@ namespace ecs
 
 		EntityID startIndex = 0;	// The index (in main entity array) of the first entity in this group
 		EntityID noOfEntities = 0;	// The number of entities in this group
-		CompMask compMask = 0;		// The components used by this group
+		CompMask compMask;		// The components used by this group
 	};
 
 #endif
@@ -187,7 +1214,7 @@ public:
 	void destroyEntity(EntityID id);
 	void switchEntities(EntityID a, EntityID b);
 	void transferEntity(EntityID from, EntityID to);
-	bool entityIsDead(EntityID id) { return entities[id].compMask == 0; };
+	bool entityIsDead(EntityID id) { return entities[id].compMask.none(); };
 
 	template <class ... T> void initComponents();
 	template<class ... T> void processSystems(float DeltaTime);
@@ -198,17 +1225,151 @@ public:
 	template<class T> void assignComp(EntityID ID);
 	template<class T> void unassignComp(EntityID ID);
 
+	// Disabled components keep their data and place in pools and groups but are skipped by queries, toggling them is O(1)
+	template<class T> void disableComp(EntityID ID);
+	template<class T> void enableComp(EntityID ID);
+	template<class T> bool compIsEnabled(EntityID ID);
+
 	template<class ... ComponentClasses> unique_ptr<vector<EntityID>> getEntitiesWithComponents();	// This should only be use for nested looping as it may be faster than normal method
-	template<class T> T* getEntitysComponent(EntityID entityID);
+	template<class T> T* getEntitysComponent(EntityID entityID);		// Marks the component as changed
+	template<class T> const T* readEntitysComponent(EntityID entityID);	// Doesn't mark the component as changed
+	template<class T> void markChanged(EntityID entityID);				// For components written without getEntitysComponent (e.g. through getComponentArray)
+	Tick getTick() { return currentTick; };
 	// Inlining a parameter pack function may result in large function bodies which would hurt instruction cache?
 	// Not super sure since I imagine compilers would just loop in instruciton cache and you can't guarantee the compiler would inline this anyway. 
+#if ECS_COMPONENT_ID_CONFIG == 1
 	template<class ... T> inline CompMask getCompMask();	
+#elif ECS_COMPONENT_ID_CONFIG == 2
+	// The comp IDs are known at compile time, so the mask is a constant expression
+	template<class ... T> static constexpr CompMask getCompMask()
+	{
+		CompMask output;
+
+		// Set the component mask bits (singletons in the list aren't per entity components)
+		([&] { if constexpr (!ecs::IsSingleton<T>::value) output.set(getCompID<typename ecs::QueryComponent<T>::type>()); }(), ...);
+		return output;
+	}
+#endif
+
+	// Runtime components are for component types that are only known at runtime, e.g. defined by scripts or mods. They get a comp ID and a pool
+	// like any other component, so they are in comp masks and queries as normal and every lookup by comp ID is O(1). Like compiled components
+	// their data is moved with memcpy. A size of 0 makes a tag. The destroy callback is called when the component is unassigned, or its entity
+	// or world is destroyed. A component with a destroy callback needs a copy callback to be forked
+	CompID registerComponent(const std::string& name, size_t size, size_t alignment, void (*construct)(void*) = 0, void (*destroy)(void*) = 0,
+		void (*copy)(void*, const void*) = 0);
+	int getRuntimeCompID(const std::string& name);		// Searches by name, so look the ID up once rather than every frame (-1 if it isn't found)
+	void assignComp(CompID compID, EntityID entityID);
+	void unassignComp(CompID compID, EntityID entityID);
+	void* getEntitysComponent(CompID compID, EntityID entityID);	// Marks the component as changed
+	unique_ptr<vector<EntityID>> getEntitiesWithComponents(CompMask compMask);
+
+	// Hash indices on a component field, e.g. createIndex<&c::NetId::id>(true) then findEntity<&c::NetId::id>(x) for O(1) lookups by value
+	// They are kept up to date as components are assigned, written, removed and moved by refactoring
+	template<auto Field> void createIndex(bool bUnique = false);
+	template<auto Field> EntityID findEntity(const typename ecs::FieldIndex<Field>::Value& value);		// EntityID(-1) if no entity has the value
+	template<auto Field> vector<EntityID> findEntities(const typename ecs::FieldIndex<Field>::Value& value);
+
+	// Ordered indices on a component field, e.g. createRangeIndex<&c::Timer::expiry>() then findEntitiesInRange<&c::Timer::expiry>(lowest, now)
+	// They are kept up to date in the same way as the hash indices, a field can have both
+	template<auto Field> void createRangeIndex();
+	// The entities with values in [lower, upper), in order of their values
+	template<auto Field> vector<EntityID> findEntitiesInRange(const typename ecs::RangeIndex<Field>::Value& lower, const typename ecs::RangeIndex<Field>::Value& upper);
+
+	// Grid indices on a 2D position field, e.g. createGridIndex<&c::Position::position>(16.f) then findEntitiesInRadius<&c::Position::position>(centre, 5.f)
+	// The cell size should be around the size of a typical query. Written positions are re-read before the next query, only moving entities between cells if needed
+	template<auto Field> void createGridIndex(float cellSize);
+	// The entities within the radius of the centre, or within the box (inclusive)
+	template<auto Field> vector<EntityID> findEntitiesInRadius(const typename ecs::GridIndex<Field>::Value& centre, float radius);
+	template<auto Field> vector<EntityID> findEntitiesInBox(const typename ecs::GridIndex<Field>::Value& min, const typename ecs::GridIndex<Field>::Value& max);
+
+	// Singletons are stored once per ECS, for shared state such as the time or input
+	template<class T> T& setSingleton(const T& value);
+	template<class T> T& singleton();
+	template<class T> bool hasSingleton();
+
+	// Buffers, see ecs::Buffer
+	template<class B> ecs::BufferRef<B> getBuffer(EntityID entityID);		// Marks the component as changed
+	// Reclaim overflow blocks that are no longer used, this is also done by performFullRefactor and each finished defragmentComponents pass
+	void compactBufferArena();
+
+	// Hierarchy, both entities must have the ecs::Hierarchy component
+	void setParent(EntityID child, EntityID parent);
+	void removeParent(EntityID child);
+	// Reorder the hierarchy's members breadth first by depth so looping through them in order always reaches parents before their children
+	// This moves entities, so call it between systems rather than while holding entity IDs. Under implementation 3 the members are only reordered
+	// within their own entity group, so a parent is only guaranteed to be reached before children that are in the same group
+	void sortHierarchy();
+	bool hierarchyIsSorted() { return bHierarchyIsSorted; };
+
+	// Reorder the entities with a 2D position field (any type with x and y members) by the Morton code of the grid cell they're in, so entities that
+	// are close in space are close in memory. Entities in the same cell keep their order, so sorting again after a little movement is mostly
+	// already in place. Like sortHierarchy this reorders the entities amongst their IDs (within each entity group under implementation 3)
+	template<auto Field> void sortMortonOrder(float cellSize);
+
+	// Snapshots write the whole world as a few raw blocks (the entity array, the entity groups, the sparse sets and each pool's live components)
+	// and read it back the same way, rather than entity by entity. Components are copied as bytes so they must be trivially copyable
+	// A snapshot can only be loaded by an ECS with the same configuration and components, see the definitions for what else is kept
+	// A mappable snapshot starts each pool's data on a 64KB boundary, so it can be loaded by mapSnapshot (at the cost of padding)
+	bool saveSnapshot(std::ostream& stream, bool bMappable = false);
+	bool loadSnapshot(std::istream& stream);
+	// Diffs write what has changed since a tick: the entities whose comp masks changed or that were moved (with all of their components), and
+	// the components written through mutable accessors since (like Changed<T>, writes through getComponentArray<T>() aren't seen)
+	// Pass 0 the first time, which writes every entity, then the tick returned by the last diff. Apply them in order to an ECS that started out
+	// the same, e.g. one that loaded a snapshot or applied the first diff from an empty world
+	Tick diffSnapshot(std::ostream& stream, Tick sinceTick);
+	bool applySnapshotDiff(std::istream& stream);
+	// Compressed snapshots split the snapshot into columns (each pool's data, ticks and dense array), XOR each against the same column of the last
+	// frame, shuffle the bytes of its elements together (every first byte, then every second byte...) and run length encode it. Unchanged and
+	// slowly changing columns shrink to a few bytes. The columns are encoded and decoded in parallel
+	// Pass the same history to each frame of a sequence (and another to each frame read back), or no history for a standalone snapshot
+	bool saveCompressedSnapshot(std::ostream& stream, ecs::SnapshotHistory* history = 0);
+	bool loadCompressedSnapshot(std::istream& stream, ecs::SnapshotHistory* history = 0);
+#ifdef ECS_SNAPSHOT_MMAP
+	// Loads a mappable snapshot file with the pools' components mapped straight from the file rather than read, so they're paged in as they're
+	// used. The mappings are private (copy on write), writes only copy the pages written and the clean pages are shared with other processes
+	bool mapSnapshot(const std::string& path);
+#endif
+
+	// Creates a copy of this ECS to run ahead on and throw away, e.g. for planning. The component pools are shared with the fork copy on write
+	// a page at a time, so only the pages either side writes to are copied (where ECS_FORK_COW is defined, elsewhere the live components are
+	// copied). The rest of the ECS (entities, sparse sets, groups, indices, singletons, queued events...) is copied, so singletons must be
+	// copyable. Runtime components with a destroy callback own what their bytes point to, so they're copied with their copy callback rather
+	// than shared, and can't be forked without one. The fork owns those copies and destroys them with itself. A fork can be forked, though its
+	// own forks copy its pools the first time
+	unique_ptr<ECS> fork();
+
+	// Reactive systems run on the add and remove events of a component rather than scanning every entity for new arrivals
+	// Events are only queued for components that are observed, each reactive system S has process(ECS&, const ecs::ComponentEvents&, float)
+	template<class T> void observeComponent();
+	template<class T, class ... S> void processReactiveSystems(float DeltaTime);
+	template<class T> const ecs::ComponentEvents& getComponentEvents();
+
+#if REFAC == 2
+
+	// Reorder a component's dense array (and fix its sparse set) so that looping through entities in order walks through the array in order
+	template<class T> void sortComponents();
+	// Reorder a component's dense array to match the order of another component's dense array, entities without U end up at the back
+	template<class T, class U> void sortComponentsLike();
+
+	// Get (creating it if it doesn't exist) the owning group of these components. A component can only be owned by one group
+	template<class ... T> ecs::OwningGroup* group();
+	// Get the start of a component's dense array and the entities which own each element, used to loop through owning groups
+	template<class T> T* getComponentArray();
+	template<class T> const vector<EntityID>& getComponentOwners();
+
+	// Incrementally move components back into entity order, see the definition for details
+	bool defragmentComponents(size_t budget);
+
+#endif
 
 #if IMPL == 3
 
 	void performFullRefactor();
 	vector<ecs::EntityGroup*>& getEntityGroups() { return entityGroups; };
 
+	// Have each performFullRefactor finish by calling sortMortonOrder<Field>(cellSize), so the new groups are laid out spatially
+	template<auto Field> void setRefactorMortonOrder(float cellSize);
+
 #endif
 
 	// Getters
@@ -224,45 +1385,230 @@ public:
 	// Implementation 2 and 3 organize all alive entities to the begining of the array, thus return that number
 	EntityID getNoOfEntities() { return noOfEntities; };
 
-#endif
+#endif
+
+	inline bool entityHasComponents(const EntityID index, const CompMask compMask);
+
+protected:
+	// Entities
+	array<ecs::EntityDesignation, MAX_ENTITIES> entities;
+	array<Tick, MAX_ENTITIES> entityTicks = {};	// The tick each entity's masks last changed on or it was moved, see diffSnapshot
+	EntityID noOfEntities = 0;
+
+	// Component Pools
+	vector<ecs::ComponentPool*> componentPools;	// Vector of pointers used because component pools can be very large and it's only set on init, then just read
+
+	// The components that store data. Empty components (tags) are only bits in the comp masks, they have no pool (or sparse set) at all
+	CompMask componentDataMask;
+
+	// Singletons, indexed by the type's index from ecs::getTypeIndex<T>()
+	vector<ecs::SingletonStorage> singletons;
+
+	// Change detection
+	// The tick is advanced before each system runs (and after all have run), components are stamped with the tick they are written on
+	// and Changed<T> in a query matches components stamped after the running system's previous run
+	Tick currentTick = 1;
+	Tick systemLastTick = 0;	// The tick the running system last ran on (0 outside of systems, so Changed<T> matches any written component)
+	vector<Tick> systemTicks;	// The tick each system last ran on, indexed by the system's index from ecs::getTypeIndex<T>()
+	Tick loadTick = 0;			// The tick the last snapshot was loaded on, every component counts as written on it at least (so the loaded ticks, which may be mapped, aren't rewritten)
+
+	// Disabled components
+	// The number of entities with each component disabled (indexed by comp ID) and the components with at least one, so queries only check
+	// each entity's disabled mask when a component they use is disabled somewhere
+	vector<size_t> disabledCounts;
+	CompMask disabledCompMask;
+
+	// Runtime components, indexed by comp ID (compiled components have an empty entry)
+	vector<ecs::RuntimeComponent> runtimeComponents;
+	CompMask runtimeDestroyMask;			// The runtime components with a destroy callback
+	size_t firstRuntimeCompID = MAX_COMPONENTS;	// With ECS_COMPONENT_ID_CONFIG 2 the declared components must have lower comp IDs than any runtime component
+
+	// Field indices, and each index by the type index of its ecs::FieldIndex, ecs::RangeIndex or ecs::GridIndex
+	vector<ecs::ComponentIndex*> componentIndices;
+	vector<ecs::ComponentIndex*> fieldIndices;
+	vector<vector<ecs::ComponentIndex*>> indicesByComp;	// Each component's own indices, indexed by comp ID
+	CompMask indexedCompMask;		// The components with at least one index
+
+	// Buffers
+	ecs::BufferArena bufferArena;
+	CompMask bufferCompMask;			// The components that are buffers
+	vector<size_t> bufferElementSizes;	// The size of a buffer component's elements, indexed by comp ID
+
+	// Hierarchy
+	int hierarchyCompID = -1;			// The comp ID of ecs::Hierarchy (-1 if it hasn't been created)
+	bool bHierarchyIsSorted = true;		// Whether the members are still in breadth first order, any change to the links or move of a member clears this
+	bool bDeferRelink = false;			// Set by placeEntities, which points the links at the entities' new IDs once they've all been placed
+
+	// Reactive systems
+	// The components being observed and the events queued for each, indexed by comp ID
+	CompMask observedMask;
+	vector<ecs::ComponentEvents> componentEvents;
+
+#if ECS_COMPONENT_ID_CONFIG == 1
+
+	// This ECS's comp ID of each type, indexed by the type's index from ecs::getTypeIndex<T>() (-1 if the type isn't a component of this ECS)
+	vector<int> componentIDs;
+
+#endif
+	
+#if REFAC == 2
+
+	// Sparse set linking entity ID to it's component ID rather than them being the same ID (allows for more efficient component movement in theory)
+	// The index of the vector returns the sparse set of the component pool at the same index in the component pools. i.e. index 1 in the component pools has its sparse set in index 1 here. 
+	// The sparse sets keep their component pools packed, so there is no need to track which components in the dense array are in use
+	vector<ecs::SparseSet*> componentSparseSets;
+
+	// The owning groups, and the group that owns each component (or null) indexed by comp ID
+	vector<ecs::OwningGroup*> owningGroups;
+	vector<ecs::OwningGroup*> componentOwningGroups;
+
+	// Progress of the current defragment pass, the next entity to examine and the next dense slot to fill in each component's dense array
+	EntityID defragmentCursor = 0;
+	vector<EntityID> defragmentSlots;
+
+#endif
+
+#if IMPL == 3
+
+	vector<ecs::SortingGroup*> sortingGroups;
+	vector<ecs::EntityGroup*> entityGroups;
+
+	// The Morton sort run at the end of performFullRefactor (null if there isn't one)
+	void (*refactorMortonSort)(ECS&, float) = 0;
+	float refactorMortonCellSize = 0.f;
+
+#endif
+
+	/* ----------------------- Protected Functions Defined in Header----------------------- */
+#if ECS_COMPONENT_ID_CONFIG == 1
+	template<class T> inline CompID getCompID();
+#elif ECS_COMPONENT_ID_CONFIG == 2
+	template<class T> static constexpr CompID getCompID();
+#endif
+	template<class T> void createComp();
+	template<class T> bool querySingletonIsSet();
+	template<class T> bool queryChangeFilter(EntityID entityID);
+	template<class T> void processSystem(float DeltaTime);
+	template<class T, class S> void processReactiveSystem(const ecs::ComponentEvents& events, float DeltaTime);
+
+	// Returns the index of an entity's component in the component's pool
+	inline size_t getComponentIndex([[maybe_unused]] CompID compID, EntityID entityID)
+	{
+#if REFAC == 1
+		return entityID;	// Components are indexed by the entity ID
+#elif REFAC == 2
+		return componentSparseSets[compID]->index(entityID);	// The sparse set gives the index in the dense array
+#endif
+	}
+
+	// Calls func with the ID of each alive entity that has this component
+	template<class F> void forEachEntityWithComponent(CompID compID, F func)
+	{
+#if IMPL < 3
+
+		for (int i = 0; i < getNoOfEntities(); i++)
+			if (entities[i].compMask.test(compID))
+				func((EntityID)i);
 
-	inline bool entityHasComponents(const EntityID index, const CompMask compMask);
+#elif IMPL == 3
 
-protected:
-	// Entities
-	array<ecs::EntityDesignation, MAX_ENTITIES> entities;
-	EntityID noOfEntities = 0;
+		// Until the first refactor the entities are packed at the start of the array, afterwards they are in groups (which may have gaps between them)
+		if (entityGroups.empty())
+		{
+			for (int i = 0; i < getNoOfEntities(); i++)
+				if (entities[i].compMask.test(compID))
+					func((EntityID)i);
+		}
+		else
+		{
+			for (auto* group : entityGroups)
+				if (group->compMask.test(compID))
+					for (int i = group->startIndex; i < group->getNextIndex(); i++)
+						func((EntityID)i);
+		}
 
-	// Component Pools
-	vector<ecs::ComponentPool*> componentPools;	// Vector of pointers used because component pools can be very large and it's only set on init, then just read
-	
-#if REFAC == 2
+#endif
+	}
 
-	// Sparse set linking entity ID to it's component ID rather than them being the same ID (allows for more efficient component movement in theory)
-	// The entity ID index has element which is the index to the component.
-	// The index of the vector returns the sparse set array of the component pool is the same index in the component pools. i.e. index 1 in the component pools has its sparse set in index 1 here. 
-	vector<array<EntityID, MAX_ENTITIES>*> componentSparseSets;
+	// Returns whether an entity is a member of the hierarchy, and its hierarchy component if it is
+	inline bool inHierarchy(EntityID entityID)
+	{
+		return hierarchyCompID != -1 && entities[entityID].compMask.test((CompID)hierarchyCompID);
+	}
+	// Doesn't stamp the component, for following the links
+	inline const ecs::Hierarchy* readHierarchy(EntityID entityID)
+	{
+		return static_cast<const ecs::Hierarchy*>(componentPools[hierarchyCompID]->get(getComponentIndex((CompID)hierarchyCompID, entityID)));
+	}
+	// Like getEntitysComponent this stamps the component as written, so diffs see changed links
+	inline ecs::Hierarchy* getHierarchy(EntityID entityID)
+	{
+		const size_t compIndex = getComponentIndex((CompID)hierarchyCompID, entityID);
+		componentPools[hierarchyCompID]->ticks[compIndex] = currentTick;
+		return static_cast<ecs::Hierarchy*>(componentPools[hierarchyCompID]->get(compIndex));
+	}
 
-	// Unfortunately, the sparse set method needs a way to know which components in the dense array aren't in use.
-	// I believe the best way to do this would be to create a dense bitset to use as a reference because it is memory efficient,
-	// and doesn't modify regular runtime performance of the components 
+	// The entity's masks have changed, or it has moved
+	inline void touchEntity(EntityID entityID)
+	{
+		entityTicks[entityID] = currentTick;
+	}
 
-	// A vector of bitsets corresponding to each component (dense) array. 
-	// If value is 1 at bit number n, then the component in the dense array at index n is currently in use by an entity
-	vector<bitset<MAX_ENTITIES>*> componentAvailabilityBitsets;	
+	// Queue an add or remove event if the component is observed
+	inline void queueAddedEvent(CompID compID, EntityID entityID)
+	{
+		if (observedMask.test(compID))
+			componentEvents[compID].add(entityID);
+	}
+	inline void queueRemovedEvent(CompID compID, EntityID entityID)
+	{
+		if (!observedMask.test(compID))
+			return;
 
-#endif
+		// If the entity gained the component since the last drain, the two events cancel out
+		if (!componentEvents[compID].cancelAdd(entityID))
+			componentEvents[compID].removed.push_back(entityID);
+	}
 
-#if IMPL == 3
+	/* ----------------------- Protected Functions Defined in CPP ----------------------- */
+	void resizeComponentArrays(size_t noOfComponents);
+	void beginSystem(size_t typeIndex);
+	void endSystem(size_t typeIndex);
+	void enableCompByID(CompID compID, EntityID entityID);
+	void enableAllComps(EntityID entityID);
+	void detachFromHierarchy(EntityID entityID);
+	void updateHierarchyDepths(EntityID entityID);
+	void relinkHierarchy(EntityID a, EntityID b);
+	void placeEntities(vector<EntityID>& ranked);
+	void placeMortonOrder(CompID compID, vector<std::pair<uint64_t, EntityID>>& codes);
+	size_t getEntityEnd();
+	ecs::SnapshotHeader getSnapshotHeader(const char* magic = "ECSS");
+	void writeSnapshot(ecs::SnapshotSink& sink, bool bMappable);
+	bool readSnapshot(std::istream& stream, int mappedFile);
+	template<class Index, class ... Args> void addIndex(Args ... args);
+	template<class Index> Index* getIndex();
+	void indexComponent(CompID compID, EntityID entityID);
+	void unindexComponents(CompMask compMask, EntityID entityID);
+	void moveIndexedComponents(EntityID from, EntityID to);
+	void switchIndexedComponents(EntityID a, EntityID b);
+	void markIndexedComponentDirty(CompID compID, EntityID entityID);
+	void refreshDirtyIndexEntries(ecs::ComponentIndex* index);
+	void moveQueuedEvents(EntityID from, EntityID to);
+	void switchQueuedEvents(EntityID a, EntityID b);
 
-	vector<ecs::SortingGroup*> sortingGroups;
-	vector<ecs::EntityGroup*> entityGroups;
+#if REFAC == 2
 
-#endif
+	void addToSparseSet(CompID compID, EntityID entityID);
+	void removeFromSparseSet(CompID compID, EntityID entityID);
+	void switchDenseComponents(CompID compID, EntityID a, EntityID b);
+	void sortComponentPool(CompID compID);
+	void sortComponentPoolLike(CompID compID, CompID likeCompID);
+	ecs::OwningGroup* createOwningGroup(CompMask compMask);
+	void packOwningGroup(ecs::OwningGroup* group);
+	void enterOwningGroup(CompID compID, EntityID entityID);
+	void leaveOwningGroup(CompID compID, EntityID entityID);
 
-	/* ----------------------- Protected Functions Defined in Header----------------------- */
-	template<class T> static inline CompID getCompID();
-	template<class T> void createComp();
+#endif
 };
 
 // Function templates called from outside this class cannot be defined in the cpp for some reason. 
@@ -281,7 +1627,7 @@ EntityID ECS::createEntity()
 	for (int i = 0; i < entities.size(); i++)
 	{
 		// If dead
-		if (entities[i].compMask == 0)
+		if (entities[i].compMask.none())
 		{
 			// Use this space
 			assignComps<T ...>(i);	// Assign components
@@ -341,7 +1687,7 @@ EntityID ECS::createEntity()
 	auto moveEntityToEndOfGroup = [&](EntityID entityToMove, auto& moveEntityToEndOfGroup)
 	{
 		// If entity is dead, return
-		if (entities[entityToMove].compMask == 0)
+		if (entities[entityToMove].compMask.none())
 			return;
 
 		// Get group of this entity - Because it's not dead it should have a group
@@ -354,7 +1700,7 @@ EntityID ECS::createEntity()
 		//std::cout << "Next Index: " << (int)newIndex << '\n';
 
 		// See if there isn't a vacancy at the end of this group
-		if (entities[newIndex].compMask != 0)
+		if (entities[newIndex].compMask.any())
 		{
 			// Move that entity out the way
 			moveEntityToEndOfGroup(newIndex, moveEntityToEndOfGroup);
@@ -371,7 +1717,7 @@ EntityID ECS::createEntity()
 	{
 		// See if there isn't a vancancy at the end of this group
 		const auto newIndex = entityGroup->getNextIndex();
-		if (entities[newIndex].compMask != 0)
+		if (entities[newIndex].compMask.any())
 		{
 			// There is not a vacancy, the entity that is in the way must be moved to the end of its group.
 			// If there is an entity in the way there just repeat until done
@@ -436,53 +1782,116 @@ void ECS::initComponents()
 template<class ... T>
 void ECS::processSystems(float DeltaTime)
 {
-	(T::process(*this, DeltaTime), ...);
+	(processSystem<T>(DeltaTime), ...);
+
+	// Anything written between frames gets its own tick so every system sees it
+	currentTick++;
 }
 
 template<class T>
-void ECS::assignComp(EntityID entityID)
+void ECS::processSystem(float DeltaTime)
 {
-	// Set comp mask
-	entities[entityID].compMask.set(getCompID<T>());
+	beginSystem(ecs::getTypeIndex<T>());
+	T::process(*this, DeltaTime);
+	endSystem(ecs::getTypeIndex<T>());
+}
 
-#if REFAC == 1
+template<class T>
+void ECS::observeComponent()
+{
+	observedMask.set(getCompID<T>());
+}
 
-	// This method just uses the same index as the entity, thus we can just initalize the component and be done. 
+// Drains the events queued for T, giving all of them to each reactive system in turn
+template<class T, class ... S>
+void ECS::processReactiveSystems(float DeltaTime)
+{
+	const CompID compID = getCompID<T>();
+	if (componentEvents[compID].empty())
+		return;
 
-#elif REFAC == 2
+	// Take the queue first so events caused by the reactive systems themselves are kept for the next drain
+	// The IDs given to the systems are only kept up to date until they run, so destroying entities under implementation 2 or 3 should be done after looping through them
+	ecs::ComponentEvents events;
+	std::swap(events, componentEvents[compID]);
 
-	// This method utilizes the sparse set to get the component index from the entity index
+	(processReactiveSystem<T, S>(events, DeltaTime), ...);
+
+	// Hand the (now empty) buffers back so the queue doesn't reallocate every frame
+	if (componentEvents[compID].empty())
+	{
+		events.clear();
+		std::swap(events, componentEvents[compID]);
+	}
+}
+
+template<class T, class S>
+void ECS::processReactiveSystem(const ecs::ComponentEvents& events, float DeltaTime)
+{
+	beginSystem(ecs::getTypeIndex<S>());
+	S::process(*this, events, DeltaTime);
+	endSystem(ecs::getTypeIndex<S>());
+}
+
+template<class T>
+const ecs::ComponentEvents& ECS::getComponentEvents()
+{
+	return componentEvents[getCompID<T>()];
+}
 
-	// Get component ID (in the array of arrays (components) which array is our component?)
-	const auto compID = getCompID<T>();
+template<class T>
+void ECS::assignComp(EntityID entityID)
+{
+	touchEntity(entityID);
 
-	// Get reference to the component availability bitset to find first available space
-	auto* availabilityBitset = componentAvailabilityBitsets[compID];
+	// Re-assigning a component only re-initializes it, so it's only an add event if the entity didn't have it
+	if (!entities[entityID].compMask.test(getCompID<T>()))
+		queueAddedEvent(getCompID<T>(), entityID);
 
-	// Get reference to sparse set to assign the component to this entity
-	auto* sparseSet = componentSparseSets[compID];
+	// The hierarchy's links are about to be reset, so take the entity out of the hierarchy first
+	if constexpr (std::is_same_v<T, ecs::Hierarchy>)
+	{
+		if (entities[entityID].compMask.test(getCompID<T>()))
+			detachFromHierarchy(entityID);
+		bHierarchyIsSorted = false;
+	}
 
-	// Find available spot (this is linear time and much slower than REFAC 1's constant time here)
-	for (int i = 0; i < MAX_ENTITIES; i++)
+	// Tags have no data, so they are just a bit in the comp mask
+	if constexpr (std::is_empty_v<T>)
 	{
-		// If this sparse set has a vacanncy
-		if (!availabilityBitset->test(i))
-		{
-			// Set the bit
-			availabilityBitset->set(i);
+		entities[entityID].compMask.set(getCompID<T>());
+		return;
+	}
+
+#if REFAC == 1
 
-			// Assign component to entity in sparse set
-			(*sparseSet)[entityID] = i;
+	// This method just uses the same index as the entity, thus we can just initalize the component and be done. 
 
-			break;
-		}
+#elif REFAC == 2
+
+	// This method utilizes the sparse set to get the component index from the entity index
+	// The component is appended to the end of the dense array in constant time.
+	// If the entity already has this component it keeps its current slot and is just re-initialized below
+	if (!entities[entityID].compMask.test(getCompID<T>()))
+	{
+		entities[entityID].compMask.set(getCompID<T>());
+		addToSparseSet(getCompID<T>(), entityID);	// The comp mask must be set first so owning groups can see the entity has the component
 	}
 
 #endif
 
+	// Set comp mask
+	entities[entityID].compMask.set(getCompID<T>());
+
 	// Call default constructor to initialise variables in the component
-	T* comp = getEntitysComponent<T>(entityID);
-	*comp = T();
+	if constexpr (!std::is_empty_v<T>)
+	{
+		T* comp = getEntitysComponent<T>(entityID);
+		*comp = T();
+	}
+
+	if (indexedCompMask.test(getCompID<T>()))
+		indexComponent(getCompID<T>(), entityID);
 
 }
 
@@ -495,25 +1904,248 @@ void ECS::assignComps(EntityID ID)
 template<class T>
 void ECS::unassignComp(EntityID ID)
 {
+	// Return if the entity doesn't have this component
+	if (!entities[ID].compMask.test(getCompID<T>()))
+		return;
+
+	touchEntity(ID);
+
+	// Unlink the entity from its parent and children
+	if constexpr (std::is_same_v<T, ecs::Hierarchy>)
+		detachFromHierarchy(ID);
+
+	if (indexedCompMask.test(getCompID<T>()))
+		unindexComponents(getCompMask<T>(), ID);
+
+#if REFAC == 2
+
+	// Free the component's slot, this moves the last component of the dense array into it
+	if constexpr (!std::is_empty_v<T>)
+		removeFromSparseSet(getCompID<T>(), ID);
+
+#endif
+
+	// A component that is assigned again starts enabled
+	enableCompByID(getCompID<T>(), ID);
+
 	entities[ID].compMask.set(getCompID<T>(), false);
+	queueRemovedEvent(getCompID<T>(), ID);
+}
+
+template<class T>
+void ECS::disableComp(EntityID ID)
+{
+	const CompID compID = getCompID<T>();
+
+	// Return if the entity doesn't have this component or it's already disabled
+	if (!entities[ID].compMask.test(compID) || entities[ID].disabledMask.test(compID))
+		return;
+
+	touchEntity(ID);
+	entities[ID].disabledMask.set(compID);
+	if (disabledCounts[compID]++ == 0)
+		disabledCompMask.set(compID);
+}
+
+template<class T>
+void ECS::enableComp(EntityID ID)
+{
+	enableCompByID(getCompID<T>(), ID);
+}
+
+template<class T>
+bool ECS::compIsEnabled(EntityID ID)
+{
+	return entities[ID].compMask.test(getCompID<T>()) && !entities[ID].disabledMask.test(getCompID<T>());
 }
 
 template<class T>
 T* ECS::getEntitysComponent(EntityID entityID)
 {
-#if REFAC == 1
+	static_assert(!std::is_empty_v<T>, "Tag components have no data, use entityHasComponents instead");
 
-	// Components are indexed in the component pool by the same index used to get the entity in the entity array (the entityID)
-	return static_cast<T*>(componentPools[getCompID<T>()]->get(entityID));
+	// REFAC 1 indexes components in the component pool by the same index used to get the entity in the entity array (the entityID)
+	// REFAC 2 has a sparse set inbetween the entity array and the component array, the element is the index in the component array
+	auto* pool = componentPools[getCompID<T>()];
+	const size_t compIndex = getComponentIndex(getCompID<T>(), entityID);
 
-#elif REFAC == 2
+	// The caller can write to the component, so mark it as changed
+	pool->ticks[compIndex] = currentTick;
+	if (indexedCompMask.test(getCompID<T>()))
+		markIndexedComponentDirty(getCompID<T>(), entityID);
+
+	return static_cast<T*>(pool->get(compIndex));
+}
+
+template<class B>
+ecs::BufferRef<B> ECS::getBuffer(EntityID entityID)
+{
+	static_assert(std::is_base_of_v<ecs::BufferHeader, B>, "Component isn't a buffer");
+
+	return ecs::BufferRef<B>(getEntitysComponent<B>(entityID), &bufferArena);
+}
+
+template<class T>
+const T* ECS::readEntitysComponent(EntityID entityID)
+{
+	static_assert(!std::is_empty_v<T>, "Tag components have no data, use entityHasComponents instead");
+
+	return static_cast<const T*>(componentPools[getCompID<T>()]->get(getComponentIndex(getCompID<T>(), entityID)));
+}
+
+template<class T>
+void ECS::markChanged(EntityID entityID)
+{
+	componentPools[getCompID<T>()]->ticks[getComponentIndex(getCompID<T>(), entityID)] = currentTick;
+	if (indexedCompMask.test(getCompID<T>()))
+		markIndexedComponentDirty(getCompID<T>(), entityID);
+}
+
+template<auto Field>
+void ECS::createIndex(bool bUnique)
+{
+	addIndex<ecs::FieldIndex<Field>>(bUnique);
+}
+
+template<auto Field>
+void ECS::createRangeIndex()
+{
+	addIndex<ecs::RangeIndex<Field>>(false);
+}
+
+template<auto Field>
+void ECS::createGridIndex(float cellSize)
+{
+	addIndex<ecs::GridIndex<Field>>(cellSize);
+}
+
+// Creates an index, the arguments are passed to its constructor after the comp ID
+template<class Index, class ... Args>
+void ECS::addIndex(Args ... args)
+{
+	const CompID compID = getCompID<typename Index::Component>();
+
+	// Each field can only have one index of each kind
+	const size_t typeIndex = ecs::getTypeIndex<Index>();
+	if (typeIndex >= fieldIndices.size())
+		fieldIndices.resize(typeIndex + 1, 0);
+	assert(!fieldIndices[typeIndex]);
+
+	auto* index = new Index(compID, args ...);
+	fieldIndices[typeIndex] = index;
+	componentIndices.push_back(index);
+	indicesByComp[compID].push_back(index);
+	indexedCompMask.set(compID);
+
+	// Index the entities that already have the component
+	forEachEntityWithComponent(compID, [&](EntityID entityID)
+	{
+		index->add(entityID, componentPools[compID]->get(getComponentIndex(compID, entityID)));
+	});
+}
+
+template<auto Field>
+EntityID ECS::findEntity(const typename ecs::FieldIndex<Field>::Value& value)
+{
+	auto* index = getIndex<ecs::FieldIndex<Field>>();
+	auto it = index->values.find(value);
+	return it == index->values.end() ? EntityID(-1) : it->second;
+}
+
+template<auto Field>
+vector<EntityID> ECS::findEntities(const typename ecs::FieldIndex<Field>::Value& value)
+{
+	auto* index = getIndex<ecs::FieldIndex<Field>>();
+	vector<EntityID> output;
+	auto range = index->values.equal_range(value);
+	for (auto it = range.first; it != range.second; it++)
+		output.push_back(it->second);
+	return output;
+}
+
+template<auto Field>
+vector<EntityID> ECS::findEntitiesInRange(const typename ecs::RangeIndex<Field>::Value& lower, const typename ecs::RangeIndex<Field>::Value& upper)
+{
+	auto* index = getIndex<ecs::RangeIndex<Field>>();
+	vector<EntityID> output;
+	if (!(lower < upper))
+		return output;
+
+	// The values are ordered, so the range is a contiguous run starting at the first value not less than lower
+	const auto end = index->values.lower_bound(upper);
+	for (auto it = index->values.lower_bound(lower); it != end; it++)
+		output.push_back(it->second);
+	return output;
+}
+
+template<auto Field>
+vector<EntityID> ECS::findEntitiesInRadius(const typename ecs::GridIndex<Field>::Value& centre, float radius)
+{
+	auto* index = getIndex<ecs::GridIndex<Field>>();
+	vector<EntityID> output;
+
+	const float x = (float)centre.x, y = (float)centre.y;
+	index->forEachInCells(x - radius, y - radius, x + radius, y + radius, [&](const auto& element)
+	{
+		const float dx = (float)element.position.x - x, dy = (float)element.position.y - y;
+		if (dx * dx + dy * dy <= radius * radius)
+			output.push_back(element.entityID);
+	});
+	return output;
+}
+
+template<auto Field>
+vector<EntityID> ECS::findEntitiesInBox(const typename ecs::GridIndex<Field>::Value& min, const typename ecs::GridIndex<Field>::Value& max)
+{
+	auto* index = getIndex<ecs::GridIndex<Field>>();
+	vector<EntityID> output;
+
+	index->forEachInCells((float)min.x, (float)min.y, (float)max.x, (float)max.y, [&](const auto& element)
+	{
+		if (element.position.x >= min.x && element.position.x <= max.x && element.position.y >= min.y && element.position.y <= max.y)
+			output.push_back(element.entityID);
+	});
+	return output;
+}
+
+template<auto Field>
+void ECS::sortMortonOrder(float cellSize)
+{
+	typedef typename ecs::FieldPointer<decltype(Field)>::component Component;
+	const CompID compID = getCompID<Component>();
+
+	// Find the code of each entity's cell
+	vector<std::pair<uint64_t, EntityID>> codes;
+	forEachEntityWithComponent(compID, [&](EntityID entityID)
+	{
+		const auto& position = static_cast<Component*>(componentPools[compID]->get(getComponentIndex(compID, entityID)))->*Field;
+		codes.push_back({ ecs::getMortonCode((int32_t)std::floor((float)position.x / cellSize), (int32_t)std::floor((float)position.y / cellSize)), entityID });
+	});
+
+	placeMortonOrder(compID, codes);
+}
 
-	// There is now a sparse set inbetween the entity array and the component array. 
-	// To get the index to the component array the entityID is used in the sparse set, the element is the index in the component array
-	const EntityID compIndex = componentSparseSets[getCompID<T>()]->at(entityID);
-	return static_cast<T*>(componentPools[getCompID<T>()]->get(compIndex));
+#if IMPL == 3
+
+template<auto Field>
+void ECS::setRefactorMortonOrder(float cellSize)
+{
+	refactorMortonSort = [](ECS& ecs, float cellSize) { ecs.sortMortonOrder<Field>(cellSize); };
+	refactorMortonCellSize = cellSize;
+}
 
 #endif
+
+// Returns an index with every written component re-read, ready to be searched
+template<class Index>
+Index* ECS::getIndex()
+{
+	const size_t typeIndex = ecs::getTypeIndex<Index>();
+	assert(typeIndex < fieldIndices.size() && fieldIndices[typeIndex]);	// The field must have been indexed with createIndex<>(), createRangeIndex<>() or createGridIndex<>()
+
+	auto* index = static_cast<Index*>(fieldIndices[typeIndex]);
+	refreshDirtyIndexEntries(index);
+	return index;
 }
 
 // This should only be use for nested looping as it may be faster than normal method
@@ -526,70 +2158,230 @@ unique_ptr<vector<EntityID>> ECS::getEntitiesWithComponents()
 	// Get component masks
 	CompMask compMask = getCompMask<ComponentClasses ...>();
 
+	// Singletons the query reads must have been set
+	assert((querySingletonIsSet<ComponentClasses>() && ...));
+
+	// Entities only need their disabled components checked if one of these components is disabled on any entity
+	const bool bCheckDisabled = (disabledCompMask & compMask).any();
+	auto isEnabled = [&](EntityID i) { return !bCheckDisabled || (entities[i].disabledMask & compMask).none(); };
+
 #if IMPL < 3
 
 	// Get entities with these compIDs
 	for (int i = 0; i < getNoOfEntities(); i++)	// Loop through entities (depends on implementation)
-		if ((entities[i].compMask & compMask) == compMask)	// If this entity has all components required
+		if (entities[i].compMask.contains(compMask) && isEnabled(i) && (queryChangeFilter<ComponentClasses>(i) && ...))	// If this entity has all components required enabled (and they pass any Changed<T> filters)
 			output->push_back(i);	// Add this entity's ID to the output
 
 #elif IMPL == 3
 
+	// Every entity in a group has the group's components, so only the group's mask needs checking
 	for (auto group : entityGroups)
-		for (int i = group->startIndex; i < group->getNextIndex(); i++)
-			output->push_back(i);
+		if (group->compMask.contains(compMask))
+			for (int i = group->startIndex; i < group->getNextIndex(); i++)
+				if (isEnabled(i) && (queryChangeFilter<ComponentClasses>(i) && ...))	// If the entity has the components enabled (and passes any Changed<T> filters)
+					output->push_back(i);
 
 #endif
 
 	return output;
 }
 
+#if REFAC == 2
+
+template<class T>
+void ECS::sortComponents()
+{
+	sortComponentPool(getCompID<T>());
+}
+
+template<class T, class U>
+void ECS::sortComponentsLike()
+{
+	sortComponentPoolLike(getCompID<T>(), getCompID<U>());
+}
+
+template<class ... T>
+ecs::OwningGroup* ECS::group()
+{
+	const auto compMask = getCompMask<T ...>();
+
+	// Return the group if it already exists
+	for (auto* group : owningGroups)
+		if (group->compMask == compMask)
+			return group;
+
+	return createOwningGroup(compMask);
+}
+
+template<class T>
+T* ECS::getComponentArray()
+{
+	static_assert(!std::is_empty_v<T>, "Tag components have no data");
+
+	return static_cast<T*>(componentPools[getCompID<T>()]->get(0));
+}
+
+template<class T>
+const vector<EntityID>& ECS::getComponentOwners()
+{
+	return componentSparseSets[getCompID<T>()]->dense;
+}
+
+#endif
+
+#if ECS_COMPONENT_ID_CONFIG == 1
+
 template<class ... T>
 CompMask ECS::getCompMask()
 {
 	CompMask output;
 
-	// Unpack parameter pack
-	int ids[] = { getCompID<T>() ... };
-
-	// Set the component mask bits
-	for (int i = 0; i < sizeof...(T); i++)
-		output.set(ids[i]);
+	// Set the component mask bits (singletons in the list aren't per entity components)
+	([&] { if constexpr (!ecs::IsSingleton<T>::value) output.set(getCompID<typename ecs::QueryComponent<T>::type>()); }(), ...);
 
 	// Return comp mask
 	return output;
 }
 
 template<class T> 
-static CompID ECS::getCompID()
+CompID ECS::getCompID()
 {
-	static CompID output = unsetComponentID++;	// Set to current value and increment for next comp
-	return output;
+	// Look up this ECS's comp ID from the type's index O(1)
+	const size_t typeIndex = ecs::getTypeIndex<T>();
+	assert(typeIndex < componentIDs.size() && componentIDs[typeIndex] != -1);	// The component must have been created with initComponents<>()
+	return (CompID)componentIDs[typeIndex];
+}
+
+#elif ECS_COMPONENT_ID_CONFIG == 2
+
+template<class T>
+constexpr CompID ECS::getCompID()
+{
+	// The comp ID is the index of the component in the declared list, so every pool lookup is a constant offset
+	typedef typename ecs::ComponentList<T>::type List;
+	static_assert(List::template contains<T>(), "Component is missing from ECS_COMPONENTS(...)");
+	static_assert(List::count <= MAX_COMPONENTS, "ECS_COMPONENTS(...) has more components than MAX_COMPONENTS");
+
+	return (CompID)List::template indexOf<T>();
 }
 
+#endif
+
 template<class T>
 void ECS::createComp()
 {
-	// Create new component pool and add it the pools
-	componentPools.push_back(new ecs::ComponentPool(sizeof(T)));
+#if ECS_COMPONENT_ID_CONFIG == 1
+
+	// Each component can only be created once
+	const size_t typeIndex = ecs::getTypeIndex<T>();
+	if (typeIndex >= componentIDs.size())
+		componentIDs.resize(typeIndex + 1, -1);
+	assert(componentIDs[typeIndex] == -1);
 
 	// This set's the new component's ID which is the index to this pool in the vector of pools
-	// This works as long as you create all component pools initially (don't get a comp's ID before creating it's pool or the indexes will mess up)
-	getCompID<T>();
+	assert(componentPools.size() < MAX_COMPONENTS);
+	const CompID compID = (CompID)componentPools.size();
+	componentIDs[typeIndex] = compID;
+	resizeComponentArrays(compID + 1);
+
+#elif ECS_COMPONENT_ID_CONFIG == 2
+
+	// The comp ID is fixed by the component list, so make room for every component in the list (they can be created in any order)
+	const CompID compID = getCompID<T>();
+	assert(ecs::ComponentList<T>::type::count <= firstRuntimeCompID);	// initComponents<>() must be called before any runtime components are registered
+	resizeComponentArrays(ecs::ComponentList<T>::type::count);
+
+#endif
+
+	// Each component can only be created once
+	assert(!componentPools[compID]);
+
+	// Tags (empty components) have no pool, they are only stored as bits in the comp masks
+	if constexpr (std::is_empty_v<T>)
+		return;
+
+	// Create new component pool
+	componentPools[compID] = new ecs::ComponentPool(sizeof(T), alignof(T));
+	componentDataMask.set(compID);
+
+	if constexpr (std::is_same_v<T, ecs::Hierarchy>)
+		hierarchyCompID = compID;
+
+	if constexpr (std::is_base_of_v<ecs::BufferHeader, T>)
+	{
+		bufferCompMask.set(compID);
+		bufferElementSizes[compID] = sizeof(typename T::element);
+	}
 
 #if REFAC == 2
 
 	// Setup sparse set
-	componentSparseSets.push_back(new array<EntityID, MAX_ENTITIES>());
-
-	// Create indicator bitset
-	componentAvailabilityBitsets.push_back(new bitset<MAX_ENTITIES>());	// They are automatically all set to 0	
+	componentSparseSets[compID] = new ecs::SparseSet();
 
 #endif
 }
 
+template<class T>
+T& ECS::setSingleton(const T& value)
+{
+	const size_t typeIndex = ecs::getTypeIndex<T>();
+	if (typeIndex >= singletons.size())
+		singletons.resize(typeIndex + 1);
+
+	auto& storage = singletons[typeIndex];
+
+	// Overwrite the singleton if it's already set
+	if (storage.data)
+		return *static_cast<T*>(storage.data) = value;
+
+	// Create singleton
+	storage.data = new T(value);
+	storage.destroy = [](void* data) { delete static_cast<T*>(data); };
+	storage.copy = [](const void* data) -> void* { return new T(*static_cast<const T*>(data)); };
+	return *static_cast<T*>(storage.data);
+}
+
+template<class T>
+T& ECS::singleton()
+{
+	assert(hasSingleton<T>());
+	return *static_cast<T*>(singletons[ecs::getTypeIndex<T>()].data);
+}
+
+template<class T>
+bool ECS::hasSingleton()
+{
+	const size_t typeIndex = ecs::getTypeIndex<T>();
+	return typeIndex < singletons.size() && singletons[typeIndex].data;
+}
+
+// Used by queries to check that any singletons in their component list have been set
+template<class T>
+bool ECS::querySingletonIsSet()
+{
+	if constexpr (ecs::IsSingleton<T>::value)
+		return hasSingleton<typename T::type>();
+	else
+		return true;
+}
+
+// Used by queries to check an entity's component has changed since the running system last ran, if the query wants it to have changed
+template<class T>
+bool ECS::queryChangeFilter(EntityID entityID)
+{
+	if constexpr (ecs::IsChanged<T>::value)
+	{
+		static_assert(!std::is_empty_v<typename T::type>, "Tag components have no data to change");
+
+		const CompID compID = getCompID<typename T::type>();
+		return std::max(componentPools[compID]->ticks[getComponentIndex(compID, entityID)], loadTick) > systemLastTick;
+	}
+	else
+		return true;
+}
+
 bool ECS::entityHasComponents(const EntityID index, const CompMask compMask)
 {
-	return (entities[index].compMask & compMask) == compMask;
+	return entities[index].compMask.contains(compMask);
 }
 
@@ -25,6 +25,9 @@ namespace c
 	};
 }
 
+// Declare the components this ECS uses (gives them compile time comp IDs with ECS_COMPONENT_ID_CONFIG 2)
+ECS_COMPONENTS(c::Position, c::Translation)
+
 namespace s
 {
 	struct Translation